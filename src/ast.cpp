@@ -1,23 +1,41 @@
+#include <cstring>
+
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <llvm/IR/DebugInfoMetadata.h>
 
 #include "ast.h"
 #include "debug.h"
+#include "lexer.h"
 #include "llvm.h"
+#include "memReport.h"
+#include "options.h"
+#include "stats.h"
 
-std::unordered_map<char, int> binopPrecedence = {
-    {'*', 40}, {'+', 20}, {'-', 20}, {'<', 10}, {'=', 2},
+std::unordered_map<int, int> binopPrecedence = {
+    {'*', 40},    {'+', 20},   {'-', 20}, {'<', 10}, {'>', 10},
+    {tok_and, 6}, {tok_or, 5}, {'=', 2},  {':', 1},
 };
 
+// When set, errors are appended here instead of going straight to stderr, so
+// the batching REPL can replay them in source order.
+std::string *deferredErrors = nullptr;
+unsigned errorCount = 0;
+
 llvm::Value *LogErrorV(const char *str) {
-    fprintf(stderr, "Error: %s\n", str);
+    errorCount++;
+    if (deferredErrors)
+        *deferredErrors += std::string("Error: ") + str + "\n";
+    else
+        fprintf(stderr, "Error: %s\n", str);
     return nullptr;
 }
 
@@ -25,8 +43,210 @@ llvm::raw_ostream &indent(llvm::raw_ostream &o, int size) {
     return o << std::string(size, ' ');
 }
 
+// Types of the variables bound by expressions that are being analyzed rather
+// than codegen'd. These shadow NamedValues.
+std::map<std::string, ValueType> scopedTypes;
+
+// Binds variables in scopedTypes until it goes out of scope.
+class TypeScope {
+    public:
+        ~TypeScope() {
+            for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+                if (it->second)
+                    scopedTypes[it->first] = *it->second;
+                else
+                    scopedTypes.erase(it->first);
+            }
+        }
+
+        void bind(const std::string &name, ValueType type) {
+            auto old = scopedTypes.find(name);
+            saved.emplace_back(name, old == scopedTypes.end()
+                                         ? std::nullopt
+                                         : std::optional(old->second));
+            scopedTypes[name] = type;
+        }
+
+    private:
+        std::vector<std::pair<std::string, std::optional<ValueType>>> saved;
+};
+
+// Emits a call, converting each argument to the type of its parameter.
+llvm::Value *createCall(llvm::Function *f, std::vector<llvm::Value *> args,
+                        const char *name) {
+    for (unsigned i = 0; i != args.size(); i++)
+        args[i] = convertTo(args[i], f->getArg(i)->getType());
+    return Builder->CreateCall(f, args, name);
+}
+
+// Math functions that calls lower straight to intrinsics, so they fold, CSE
+// and vectorize like arithmetic instead of being opaque external calls. An
+// extern of one of these names declares the libm function the intrinsic
+// stands for anyway; a def of one takes precedence.
+struct MathBuiltin {
+        const char *name;
+        llvm::Intrinsic::ID id;
+        unsigned numArgs;
+};
+
+const MathBuiltin mathBuiltins[] = {
+    {"sqrt", llvm::Intrinsic::sqrt, 1},  {"fabs", llvm::Intrinsic::fabs, 1},
+    {"floor", llvm::Intrinsic::floor, 1}, {"sin", llvm::Intrinsic::sin, 1},
+    {"cos", llvm::Intrinsic::cos, 1},    {"exp", llvm::Intrinsic::exp, 1},
+    {"log", llvm::Intrinsic::log, 1},    {"pow", llvm::Intrinsic::pow, 2},
+    {"fma", llvm::Intrinsic::fma, 3},    {"min", llvm::Intrinsic::minnum, 2},
+    {"max", llvm::Intrinsic::maxnum, 2},
+};
+
+const MathBuiltin *findMathBuiltin(const std::string &name) {
+    for (const MathBuiltin &builtin : mathBuiltins)
+        if (name == builtin.name)
+            return &builtin;
+    return nullptr;
+}
+
+// Runtime timers that calls reach without an extern, as if the runtime had
+// declared them. An extern or def of one of these names takes precedence.
+const char *timingBuiltins[] = {"nanotime", "cycles"};
+
+// The runtime function name of type ft, declared in this module.
+llvm::Function *getRuntimeFunction(const char *name, llvm::FunctionType *ft) {
+    if (auto *f = Module->getFunction(name))
+        return f;
+    return llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name,
+                                  Module.get());
+}
+
+// Whether name has a body, either in this module or already in the JIT.
+bool isDefined(const std::string &name) {
+    llvm::Function *f = Module->getFunction(name);
+    return (f && !f->isDeclaration()) || (jit && jit->hasFunction(name)) ||
+           flushedFunctions.count(name);
+}
+
+// Bodies of user operators, kept after their definition is compiled so
+// every module that uses one can have its own copy to inline.
+struct OperatorDef {
+        std::unique_ptr<ExprAST> body;
+        bool fastMath;
+};
+
+std::map<std::string, OperatorDef> operatorDefs;
+
+bool emitFunctionBody(llvm::Function *f, PrototypeAST &p, ExprAST &body,
+                      bool fastMath);
+
+// User operators are always inlined. A whole-file compile has the definition
+// in the same module as every use, but the JIT, or an earlier chunk of a
+// streamed compile, put it in an earlier one, so the current module gets an
+// available_externally copy: it can be inlined, and any call left over still
+// goes to the original definition.
+llvm::Function *getOperatorFunction(const std::string &name) {
+    llvm::Function *f = Module->getFunction(name);
+    if (f && !f->isDeclaration())
+        return f;
+
+    auto def = operatorDefs.find(name);
+    auto proto = functionProtos.find(name);
+    if (def == operatorDefs.end() || proto == functionProtos.end())
+        return getFunction(name);
+
+    if (!f)
+        f = proto->second->codegen();
+    f->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+    f->addFnAttr(llvm::Attribute::AlwaysInline);
+
+    // The copy is emitted in the middle of the caller's body.
+    llvm::IRBuilderBase::InsertPointGuard guard(*Builder);
+    std::map<std::string, llvm::AllocaInst *> callerValues;
+    std::swap(callerValues, NamedValues);
+    if (!emitFunctionBody(f, *proto->second, *def->second.body,
+                          def->second.fastMath))
+        f->deleteBody();
+    std::swap(callerValues, NamedValues);
+    return f;
+}
+
+// The JIT's function pipeline has no inliner, so user operators are inlined
+// as each function is emitted. The module pipeline does this for compiled
+// programs.
+void inlineOperatorCalls(llvm::Function &f) {
+    std::vector<llvm::CallBase *> calls;
+    for (auto &bb : f)
+        for (auto &inst : bb)
+            if (auto *call = llvm::dyn_cast<llvm::CallBase>(&inst)) {
+                llvm::Function *callee = call->getCalledFunction();
+                if (callee && callee != &f && !callee->isDeclaration() &&
+                    callee->hasFnAttribute(llvm::Attribute::AlwaysInline))
+                    calls.push_back(call);
+            }
+
+    for (auto *call : calls) {
+        llvm::InlineFunctionInfo info;
+        llvm::InlineFunction(*call, info);
+    }
+}
+
+// Spelling of a binary operator, for dumps.
+std::string getOperatorSpelling(int op) {
+    if (op == tok_and)
+        return "&&";
+    if (op == tok_or)
+        return "||";
+    return std::string(1, (char)op);
+}
+
+// Whether every value expr assigns to name is an int, or an int literal.
+bool assignsOnlyInts(ExprAST &expr, const std::string &name) {
+    bool onlyInt = true;
+    expr.forEachAssignment(name, [&](ExprAST &value) {
+        if (value.getType() != ValueType::Int && !value.getIntConstant())
+            onlyInt = false;
+    });
+    return onlyInt;
+}
+
+// Whether expr assigns name a value that depends on an int variable.
+bool assignsIntVariables(ExprAST &expr, const std::string &name) {
+    bool uses = false;
+    expr.forEachAssignment(name, [&](ExprAST &value) {
+        if (value.usesIntVariables())
+            uses = true;
+    });
+    return uses;
+}
+
+// Whether literal is an int literal that takes on the int type of the other
+// operand. Literals are doubles unless the program opted into ints, so the
+// other side has to depend on an int variable: literal-only arithmetic
+// stays in doubles, where it can't wrap.
+bool isIntLiteralFor(ExprAST &literal, ExprAST &other) {
+    return literal.getIntConstant() && other.getType() == ValueType::Int &&
+           other.usesIntVariables();
+}
+
+// Whether expr assigns to name at all.
+bool assignsTo(ExprAST &expr, const std::string &name) {
+    bool assigns = false;
+    expr.forEachAssignment(name, [&](ExprAST &value) { assigns = true; });
+    return assigns;
+}
+
 ExprAST::ExprAST(SourceLocation loc) : loc(loc) {}
 
+ValueType ExprAST::getType() { return ValueType::Double; }
+
+void ExprAST::forEachAssignment(const std::string &name,
+                                AssignmentVisitor visit) {}
+
+bool ExprAST::usesIntVariables() { return false; }
+
+std::optional<int64_t> ExprAST::getIntConstant() { return std::nullopt; }
+
+const std::string *ExprAST::getVariableName() { return nullptr; }
+
+ExprAST *ExprAST::getUpperBound(const std::string &name) { return nullptr; }
+
 int ExprAST::getLine() const { return loc.line; }
 
 int ExprAST::getCol() const { return loc.col; }
@@ -35,7 +255,10 @@ llvm::raw_ostream &ExprAST::dump(llvm::raw_ostream &out, int ind) {
     return out << ':' << getLine() << ':' << getCol() << '\n';
 }
 
-NumberExprAST::NumberExprAST(double val) : val(val) {}
+NumberExprAST::NumberExprAST(double val, bool isInt)
+    : val(val), isInt(isInt) {
+    countAstNode(AstNode::Number, sizeof(*this));
+}
 
 llvm::Value *NumberExprAST::codegen() {
     if (debug)
@@ -43,12 +266,23 @@ llvm::Value *NumberExprAST::codegen() {
     return llvm::ConstantFP::get(*Context, llvm::APFloat(val));
 }
 
+// An int literal is still a double on its own; see isIntLiteralFor.
+ValueType NumberExprAST::getType() { return ValueType::Double; }
+
+std::optional<int64_t> NumberExprAST::getIntConstant() {
+    if (isInt)
+        return (int64_t)val;
+    return std::nullopt;
+}
+
 llvm::raw_ostream &NumberExprAST::dump(llvm::raw_ostream &out, int ind) {
     return ExprAST::dump(out << val, ind);
 }
 
 VariableExprAST::VariableExprAST(SourceLocation loc, const std::string &name)
-    : ExprAST(loc), name(name) {}
+    : ExprAST(loc), name(name) {
+    countAstNode(AstNode::Variable, sizeof(*this) + heapBytes(this->name));
+}
 
 llvm::Value *VariableExprAST::codegen() {
     llvm::AllocaInst *a = NamedValues[name];
@@ -59,16 +293,36 @@ llvm::Value *VariableExprAST::codegen() {
     return Builder->CreateLoad(a->getAllocatedType(), a, name.c_str());
 }
 
+ValueType VariableExprAST::getType() {
+    auto scoped = scopedTypes.find(name);
+    if (scoped != scopedTypes.end())
+        return scoped->second;
+
+    auto var = NamedValues.find(name);
+    if (var != NamedValues.end() && var->second &&
+        var->second->getAllocatedType()->isIntegerTy())
+        return ValueType::Int;
+    return ValueType::Double;
+}
+
+bool VariableExprAST::usesIntVariables() {
+    return getType() == ValueType::Int;
+}
+
+const std::string *VariableExprAST::getVariableName() { return &name; }
+
 llvm::raw_ostream &VariableExprAST::dump(llvm::raw_ostream &out, int ind) {
     return ExprAST::dump(out << name, ind);
 }
 
 const std::string VariableExprAST::getName() { return name; }
 
-BinaryExprAST::BinaryExprAST(SourceLocation loc, char op,
+BinaryExprAST::BinaryExprAST(SourceLocation loc, int op,
                              std::unique_ptr<ExprAST> left,
                              std::unique_ptr<ExprAST> right)
-    : ExprAST(loc), op(op), left(std::move(left)), right(std::move(right)) {}
+    : ExprAST(loc), op(op), left(std::move(left)), right(std::move(right)) {
+    countAstNode(AstNode::Binary, sizeof(*this));
+}
 
 llvm::Value *BinaryExprAST::codegen() {
     if (debug)
@@ -83,64 +337,222 @@ llvm::Value *BinaryExprAST::codegen() {
         if (!val)
             return nullptr;
 
-        llvm::Value *var = NamedValues[leftExpr->getName()];
+        llvm::AllocaInst *var = NamedValues[leftExpr->getName()];
         if (!var)
             return LogErrorV("unknown variable name");
 
+        val = convertTo(val, var->getAllocatedType());
         Builder->CreateStore(val, var);
         return val;
     }
 
+    if (op == tok_and || op == tok_or)
+        return codegenLogical();
+
+    // Programs written before >, :, unary ! and unary - were builtin define
+    // them, and their definitions take precedence, as a def of a math
+    // builtin does. Definitions of the original builtins are ignored.
+    std::string userOp = std::string("binary") + (char)op;
+    bool isUserOp = (op == '>' || op == ':') && isDefined(userOp);
+
+    // Sequencing evaluates the left side only for its effects.
+    if (op == ':' && !isUserOp) {
+        if (!left->codegen())
+            return nullptr;
+        return right->codegen();
+    }
+
     llvm::Value *l = left->codegen();
     llvm::Value *r = right->codegen();
     if (!l || !r)
         return nullptr;
 
+    llvm::Type *intTy = getLLVMType(ValueType::Int);
+    if (!isUserOp && isIntLiteralFor(*left, *right))
+        l = llvm::ConstantInt::get(intTy, *left->getIntConstant());
+    if (!isUserOp && isIntLiteralFor(*right, *left))
+        r = llvm::ConstantInt::get(intTy, *right->getIntConstant());
+
+    // Builtin operators stay in ints only when both sides are ints.
+    bool isInt = l->getType()->isIntegerTy() && r->getType()->isIntegerTy();
+    if (!isInt && strchr("+-*<>", op) && !isUserOp) {
+        l = convertTo(l, getLLVMType(ValueType::Double));
+        r = convertTo(r, getLLVMType(ValueType::Double));
+    }
+
     switch (op) {
         case '+':
+            if (isInt)
+                return Builder->CreateAdd(l, r, "addtmp");
             return Builder->CreateFAdd(l, r, "addtmp");
         case '-':
+            if (isInt)
+                return Builder->CreateSub(l, r, "subtmp");
             return Builder->CreateFSub(l, r, "subtmp");
         case '*':
+            if (isInt)
+                return Builder->CreateMul(l, r, "multmp");
             return Builder->CreateFMul(l, r, "multmp");
         case '<':
-            l = Builder->CreateFCmpULT(l, r, "cmptmp");
-            return Builder->CreateUIToFP(l, llvm::Type::getDoubleTy(*Context),
-                                         "booltmp");
+            l = isInt ? Builder->CreateICmpSLT(l, r, "cmptmp")
+                      : Builder->CreateFCmpULT(l, r, "cmptmp");
+            return Builder->CreateZExt(l, getLLVMType(ValueType::Int),
+                                       "booltmp");
+        case '>':
+            if (isUserOp)
+                break;
+            l = isInt ? Builder->CreateICmpSGT(l, r, "cmptmp")
+                      : Builder->CreateFCmpUGT(l, r, "cmptmp");
+            return Builder->CreateZExt(l, getLLVMType(ValueType::Int),
+                                       "booltmp");
         default:
             break;
     }
 
-    llvm::Function *f = getFunction(std::string("binary") + op);
+    llvm::Function *f = getOperatorFunction(userOp);
     assert(f && "binary operator not found!");
 
-    llvm::Value *ops[2] = {l, r};
-    return Builder->CreateCall(f, ops, "binop");
+    return createCall(f, {l, r}, "binop");
+}
+
+// The right side is only evaluated when the left doesn't decide the result,
+// which is 0 or 1 either way.
+llvm::Value *BinaryExprAST::codegenLogical() {
+    llvm::Value *l = left->codegen();
+    if (!l)
+        return nullptr;
+    l = createIsTrue(l, "lhscond");
+
+    llvm::Function *function = Builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *lBB = Builder->GetInsertBlock();
+    llvm::BasicBlock *rBB = llvm::BasicBlock::Create(*Context, "rhs", function);
+    llvm::BasicBlock *contBB = llvm::BasicBlock::Create(*Context, "logiccont");
+
+    if (op == tok_and)
+        Builder->CreateCondBr(l, rBB, contBB);
+    else
+        Builder->CreateCondBr(l, contBB, rBB);
+
+    Builder->SetInsertPoint(rBB);
+    llvm::Value *r = right->codegen();
+    if (!r)
+        return nullptr;
+    r = createIsTrue(r, "rhscond");
+    rBB = Builder->GetInsertBlock();
+    Builder->CreateBr(contBB);
+
+    function->insert(function->end(), contBB);
+    Builder->SetInsertPoint(contBB);
+    llvm::PHINode *p = Builder->CreatePHI(Builder->getInt1Ty(), 2, "logictmp");
+    p->addIncoming(Builder->getInt1(op == tok_or), lBB);
+    p->addIncoming(r, rBB);
+    return Builder->CreateZExt(p, getLLVMType(ValueType::Int), "booltmp");
+}
+
+// Comparisons and logic produce 0 or 1 as ints; arithmetic is int only if both
+// operands are.
+ValueType BinaryExprAST::getType() {
+    if ((op == '>' || op == ':') &&
+        isDefined(std::string("binary") + (char)op))
+        return ValueType::Double;
+    if (op == '=')
+        return left->getType();
+    if (op == ':')
+        return right->getType();
+    if (op == '<' || op == '>' || op == tok_and || op == tok_or)
+        return ValueType::Int;
+    if (op == '+' || op == '-' || op == '*')
+        return (left->getType() == ValueType::Int ||
+                isIntLiteralFor(*left, *right)) &&
+                       (right->getType() == ValueType::Int ||
+                        isIntLiteralFor(*right, *left))
+                   ? ValueType::Int
+                   : ValueType::Double;
+    return ValueType::Double;
+}
+
+bool BinaryExprAST::usesIntVariables() {
+    if (op == '=' || op == ':')
+        return right->usesIntVariables();
+    return left->usesIntVariables() || right->usesIntVariables();
+}
+
+ExprAST *BinaryExprAST::getUpperBound(const std::string &name) {
+    const std::string *var = left->getVariableName();
+    if (op == '<' && var && *var == name)
+        return right.get();
+    return nullptr;
+}
+
+void BinaryExprAST::forEachAssignment(const std::string &name,
+                                      AssignmentVisitor visit) {
+    if (op == '=') {
+        auto *var = static_cast<VariableExprAST *>(left.get());
+        if (var->getName() == name)
+            visit(*right);
+    } else
+        left->forEachAssignment(name, visit);
+    right->forEachAssignment(name, visit);
 }
 
 llvm::raw_ostream &BinaryExprAST::dump(llvm::raw_ostream &out, int ind) {
-    ExprAST::dump(out << "binary" << op, ind);
+    ExprAST::dump(out << "binary" << getOperatorSpelling(op), ind);
     left->dump(indent(out, ind) << "LHS:", ind + 1);
     right->dump(indent(out, ind) << "RHS:", ind + 1);
     return out;
 }
 
 UnaryExprAST::UnaryExprAST(char op, std::unique_ptr<ExprAST> operand)
-    : op(op), operand(std::move(operand)) {}
+    : op(op), operand(std::move(operand)) {
+    countAstNode(AstNode::Unary, sizeof(*this));
+}
 
 llvm::Value *UnaryExprAST::codegen() {
     llvm::Value *operandV = operand->codegen();
     if (!operandV)
         return nullptr;
 
-    llvm::Function *f = getFunction(std::string("unary") + op);
+    std::string userOp = std::string("unary") + op;
+    bool isInt = operandV->getType()->isIntegerTy();
+    switch (isDefined(userOp) ? 0 : op) {
+        case '-':
+            if (isInt)
+                return Builder->CreateNeg(operandV, "negtmp");
+            return Builder->CreateFNeg(operandV, "negtmp");
+        case '!':
+            operandV = createIsTrue(operandV, "nottmp");
+            return Builder->CreateZExt(Builder->CreateNot(operandV),
+                                       getLLVMType(ValueType::Int),
+                                       "booltmp");
+        default:
+            break;
+    }
+
+    llvm::Function *f = getOperatorFunction(userOp);
     if (!f)
         return LogErrorV("unknown unary operator");
 
     if (debug)
         ksDbgInfo.emitLocation(this);
 
-    return Builder->CreateCall(f, operandV, "unop");
+    return createCall(f, {operandV}, "unop");
+}
+
+ValueType UnaryExprAST::getType() {
+    if (isDefined(std::string("unary") + op))
+        return ValueType::Double;
+    if (op == '-')
+        return operand->getType();
+    if (op == '!')
+        return ValueType::Int;
+    return ValueType::Double;
+}
+
+bool UnaryExprAST::usesIntVariables() { return operand->usesIntVariables(); }
+
+void UnaryExprAST::forEachAssignment(const std::string &name,
+                                     AssignmentVisitor visit) {
+    operand->forEachAssignment(name, visit);
 }
 
 llvm::raw_ostream &UnaryExprAST::dump(llvm::raw_ostream &out, int ind) {
@@ -151,13 +563,27 @@ llvm::raw_ostream &UnaryExprAST::dump(llvm::raw_ostream &out, int ind) {
 
 CallExprAST::CallExprAST(SourceLocation loc, const std::string &callee,
                          std::vector<std::unique_ptr<ExprAST>> args)
-    : ExprAST(loc), callee(callee), args(std::move(args)) {}
+    : ExprAST(loc), callee(callee), args(std::move(args)) {
+    countAstNode(AstNode::Call, sizeof(*this) + heapBytes(this->callee) +
+                                    heapBytes(this->args));
+}
 
 llvm::Value *CallExprAST::codegen() {
     if (debug)
         ksDbgInfo.emitLocation(this);
 
+    const MathBuiltin *builtin = findMathBuiltin(callee);
+    if (builtin && !isDefined(callee))
+        return codegenBuiltin(*builtin);
+
+    if (callee == "bench" && !isDefined(callee))
+        return codegenBench();
+
     llvm::Function *calleeF = getFunction(callee);
+    for (const char *name : timingBuiltins)
+        if (!calleeF && callee == name)
+            calleeF = getRuntimeFunction(
+                name, llvm::FunctionType::get(Builder->getDoubleTy(), false));
     if (!calleeF)
         return LogErrorV("unknown function referenced");
 
@@ -171,7 +597,58 @@ llvm::Value *CallExprAST::codegen() {
             return nullptr;
     }
 
-    return Builder->CreateCall(calleeF, argsV, "calltmp");
+    return createCall(calleeF, argsV, "calltmp");
+}
+
+llvm::Value *CallExprAST::codegenBuiltin(const MathBuiltin &builtin) {
+    if (args.size() != builtin.numArgs)
+        return LogErrorV("incorrect # args passed");
+
+    llvm::Type *doubleTy = Builder->getDoubleTy();
+    std::vector<llvm::Value *> argsV;
+    for (auto &arg : args) {
+        llvm::Value *argV = arg->codegen();
+        if (!argV)
+            return nullptr;
+        argsV.push_back(convertTo(argV, doubleTy));
+    }
+
+    return Builder->CreateIntrinsic(builtin.id, {doubleTy}, argsV, nullptr,
+                                    "calltmp");
+}
+
+// bench(f, iters) names a function rather than calling it, so it can't be an
+// extern: the runtime's runbench gets f's address and prints its timings.
+llvm::Value *CallExprAST::codegenBench() {
+    if (args.size() != 2)
+        return LogErrorV("incorrect # args passed");
+
+    const std::string *name = args[0]->getVariableName();
+    llvm::Function *f = name ? getFunction(*name) : nullptr;
+    if (!f)
+        return LogErrorV("bench expects the name of a function");
+    if (f->arg_size())
+        return LogErrorV("bench expects a function with no args");
+
+    llvm::Value *iters = args[1]->codegen();
+    if (!iters)
+        return nullptr;
+
+    llvm::Type *doubleTy = Builder->getDoubleTy();
+    llvm::Type *ptrTy = Builder->getPtrTy();
+    llvm::Function *runBench = getRuntimeFunction(
+        "runbench",
+        llvm::FunctionType::get(doubleTy, {ptrTy, doubleTy, ptrTy}, false));
+    return Builder->CreateCall(runBench,
+                               {f, convertTo(iters, doubleTy),
+                                Builder->CreateGlobalStringPtr(*name)},
+                               "calltmp");
+}
+
+void CallExprAST::forEachAssignment(const std::string &name,
+                                    AssignmentVisitor visit) {
+    for (auto &arg : args)
+        arg->forEachAssignment(name, visit);
 }
 
 llvm::raw_ostream &CallExprAST::dump(llvm::raw_ostream &out, int ind) {
@@ -185,7 +662,9 @@ IfExprAST::IfExprAST(SourceLocation loc, std::unique_ptr<ExprAST> cond,
                      std::unique_ptr<ExprAST> tBranch,
                      std::unique_ptr<ExprAST> fBranch)
     : ExprAST(loc), cond(std::move(cond)), tBranch(std::move(tBranch)),
-      fBranch(std::move(fBranch)) {}
+      fBranch(std::move(fBranch)) {
+    countAstNode(AstNode::If, sizeof(*this));
+}
 
 llvm::Value *IfExprAST::codegen() {
     if (debug)
@@ -195,8 +674,7 @@ llvm::Value *IfExprAST::codegen() {
     if (!c)
         return nullptr;
 
-    c = Builder->CreateFCmpONE(
-        c, llvm::ConstantFP::get(*Context, llvm::APFloat(0.0)), "ifcond");
+    c = createIsTrue(c, "ifcond");
 
     llvm::Function *function = Builder->GetInsertBlock()->getParent();
     llvm::BasicBlock *tBB =
@@ -210,7 +688,6 @@ llvm::Value *IfExprAST::codegen() {
     llvm::Value *t = tBranch->codegen();
     if (!t)
         return nullptr;
-    Builder->CreateBr(contBB);
     tBB = Builder->GetInsertBlock();
 
     function->insert(function->end(), fBB);
@@ -218,19 +695,47 @@ llvm::Value *IfExprAST::codegen() {
     llvm::Value *f = fBranch->codegen();
     if (!f)
         return nullptr;
-    Builder->CreateBr(contBB);
     fBB = Builder->GetInsertBlock();
 
+    // The result is an int only if both branches are; otherwise the int
+    // side is converted at the end of its branch.
+    llvm::Type *type = t->getType() == f->getType()
+                           ? t->getType()
+                           : getLLVMType(ValueType::Double);
+    Builder->SetInsertPoint(tBB);
+    t = convertTo(t, type);
+    Builder->CreateBr(contBB);
+    Builder->SetInsertPoint(fBB);
+    f = convertTo(f, type);
+    Builder->CreateBr(contBB);
+
     function->insert(function->end(), contBB);
     Builder->SetInsertPoint(contBB);
-    llvm::PHINode *p =
-        Builder->CreatePHI(llvm::Type::getDoubleTy(*Context), 2, "iftmp");
+    llvm::PHINode *p = Builder->CreatePHI(type, 2, "iftmp");
 
     p->addIncoming(t, tBB);
     p->addIncoming(f, fBB);
     return p;
 }
 
+ValueType IfExprAST::getType() {
+    return tBranch->getType() == ValueType::Int &&
+                   fBranch->getType() == ValueType::Int
+               ? ValueType::Int
+               : ValueType::Double;
+}
+
+bool IfExprAST::usesIntVariables() {
+    return tBranch->usesIntVariables() || fBranch->usesIntVariables();
+}
+
+void IfExprAST::forEachAssignment(const std::string &name,
+                                  AssignmentVisitor visit) {
+    cond->forEachAssignment(name, visit);
+    tBranch->forEachAssignment(name, visit);
+    fBranch->forEachAssignment(name, visit);
+}
+
 llvm::raw_ostream &IfExprAST::dump(llvm::raw_ostream &out, int ind) {
     ExprAST::dump(out << "if", ind);
     cond->dump(indent(out, ind) << "cond: ", ind + 1);
@@ -242,14 +747,161 @@ llvm::raw_ostream &IfExprAST::dump(llvm::raw_ostream &out, int ind) {
 ForExprAST::ForExprAST(std::string &varName, std::unique_ptr<ExprAST> start,
                        std::unique_ptr<ExprAST> end,
                        std::unique_ptr<ExprAST> step,
-                       std::unique_ptr<ExprAST> body)
+                       std::unique_ptr<ExprAST> body, LoopHints hints)
     : varName(varName), start(std::move(start)), end(std::move(end)),
-      step(std::move(step)), body(std::move(body)) {}
+      step(std::move(step)), body(std::move(body)), hints(hints) {
+    countAstNode(AstNode::For, sizeof(*this) + heapBytes(this->varName));
+}
+
+// Puts the loop's hints on its backedge, where the unroller and vectorizer
+// look for them. With --loop-remarks they report whether they followed each.
+void ForExprAST::addLoopHints(llvm::Instruction *backedge) {
+    if (!hints.unroll && !hints.vectorize && !hints.interleaveCount)
+        return;
+
+    // The first operand is the loop ID itself, which makes it unique.
+    std::vector<llvm::Metadata *> ops = {nullptr};
+    auto addHint = [&](const char *name, llvm::Constant *value = nullptr) {
+        std::vector<llvm::Metadata *> hint = {
+            llvm::MDString::get(*Context, name)};
+        if (value)
+            hint.push_back(llvm::ConstantAsMetadata::get(value));
+        ops.push_back(llvm::MDNode::get(*Context, hint));
+    };
+
+    if (hints.unrollCount == 1)
+        addHint("llvm.loop.unroll.disable");
+    else if (hints.unrollCount)
+        addHint("llvm.loop.unroll.count", Builder->getInt32(hints.unrollCount));
+    else if (hints.unroll)
+        addHint("llvm.loop.unroll.enable");
+
+    // A width of 1 asks for no vectorization, but still allows interleaving.
+    if (hints.vectorize)
+        addHint("llvm.loop.vectorize.enable",
+                Builder->getInt1(hints.vectorizeWidth != 1));
+    if (hints.vectorizeWidth)
+        addHint("llvm.loop.vectorize.width",
+                Builder->getInt32(hints.vectorizeWidth));
+    if (hints.interleaveCount)
+        addHint("llvm.loop.interleave.count",
+                Builder->getInt32(hints.interleaveCount));
+
+    llvm::MDNode *loopID = llvm::MDNode::getDistinct(*Context, ops);
+    loopID->replaceOperandWith(0, loopID);
+    backedge->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+}
+
+// Beyond this, doubles can't count by one, so a counted loop stops there
+// rather than overflowing its int counter.
+constexpr int64_t maxExactInt = int64_t(1) << 53;
+
+// A loop is counted when it starts at an int literal, steps by a positive
+// int literal, continues while `var < bound` for a bound the loop can't
+// change (an int literal, or a variable it doesn't assign), and doesn't
+// assign var itself. Such a loop can run on an int counter, handing the body
+// exactly the doubles the general form would have.
+bool ForExprAST::isCounted() {
+    std::optional<int64_t> startVal = start->getIntConstant();
+    std::optional<int64_t> stepVal =
+        step ? step->getIntConstant() : std::optional<int64_t>(1);
+    ExprAST *bound = end->getUpperBound(varName);
+    if (!startVal || !stepVal || !bound)
+        return false;
+    if (*startVal < -maxExactInt || *startVal > maxExactInt || *stepVal <= 0 ||
+        *stepVal > maxExactInt)
+        return false;
+
+    TypeScope scope;
+    scope.bind(varName, ValueType::Double);
+    if (assignsTo(*body, varName))
+        return false;
+    if (bound->getIntConstant())
+        return true;
+    const std::string *boundVar = bound->getVariableName();
+    return boundVar && *boundVar != varName && !assignsTo(*body, *boundVar);
+}
+
+// Same do-while shape as the general form, but the bound is evaluated once
+// and the exit test is an int compare against a precomputed limit, which is
+// what IndVars, the unroller and the vectorizer look for.
+llvm::Value *ForExprAST::codegenCounted() {
+    llvm::Function *function = Builder->GetInsertBlock()->getParent();
+
+    llvm::Type *doubleTy = getLLVMType(ValueType::Double);
+    llvm::Type *intTy = getLLVMType(ValueType::Int);
+    llvm::AllocaInst *alloca =
+        createEntryBlockAlloca(function, varName, doubleTy);
+    llvm::AllocaInst *counter =
+        createEntryBlockAlloca(function, varName + ".iv", intTy);
+
+    if (debug)
+        ksDbgInfo.emitLocation(this);
+
+    llvm::Value *bound = end->getUpperBound(varName)->codegen();
+    if (!bound)
+        return nullptr;
+
+    // For an integral i, i < b exactly when i < ceil(b). NaN compares
+    // unordered, which `<` counts as true, so it never stops the loop.
+    llvm::Value *maxExact = llvm::ConstantInt::get(intTy, maxExactInt);
+    llvm::Value *limit = bound;
+    if (!bound->getType()->isIntegerTy()) {
+        limit = convertTo(
+            Builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil, bound), intTy);
+        limit = Builder->CreateSelect(Builder->CreateFCmpUNO(bound, bound),
+                                      maxExact, limit);
+    }
+    limit = Builder->CreateBinaryIntrinsic(llvm::Intrinsic::smin, limit,
+                                           maxExact, nullptr, "limit");
+
+    Builder->CreateStore(
+        llvm::ConstantInt::get(intTy, *start->getIntConstant()), counter);
+
+    llvm::BasicBlock *loopBB =
+        llvm::BasicBlock::Create(*Context, "loop", function);
+    Builder->CreateBr(loopBB);
+    Builder->SetInsertPoint(loopBB);
+
+    llvm::Value *iv = Builder->CreateLoad(intTy, counter, varName + ".iv");
+    Builder->CreateStore(Builder->CreateSIToFP(iv, doubleTy), alloca);
+
+    llvm::AllocaInst *oldVal = NamedValues[varName];
+    NamedValues[varName] = alloca;
+
+    if (!body->codegen())
+        return nullptr;
+
+    // The counter stays below 2^53 and so does the step, so this can't wrap.
+    int64_t stepVal = step ? *step->getIntConstant() : 1;
+    llvm::Value *next =
+        Builder->CreateNSWAdd(iv, llvm::ConstantInt::get(intTy, stepVal),
+                              "nextvar");
+    Builder->CreateStore(next, counter);
+    llvm::Value *endCond = Builder->CreateICmpSLT(next, limit, "loopcond");
+
+    llvm::BasicBlock *afterBB =
+        llvm::BasicBlock::Create(*Context, "afterloop", function);
+    addLoopHints(Builder->CreateCondBr(endCond, loopBB, afterBB));
+    Builder->SetInsertPoint(afterBB);
+
+    if (oldVal)
+        NamedValues[varName] = oldVal;
+    else
+        NamedValues.erase(varName);
+
+    return llvm::Constant::getNullValue(doubleTy);
+}
 
 llvm::Value *ForExprAST::codegen() {
+    if (isCounted())
+        return codegenCounted();
+
     llvm::Function *function = Builder->GetInsertBlock()->getParent();
 
-    llvm::AllocaInst *alloca = createEntryBlockAlloca(function, varName);
+    llvm::Type *doubleTy = getLLVMType(ValueType::Double);
+    llvm::AllocaInst *alloca =
+        createEntryBlockAlloca(function, varName, doubleTy);
 
     if (debug)
         ksDbgInfo.emitLocation(this);
@@ -257,7 +909,7 @@ llvm::Value *ForExprAST::codegen() {
     llvm::Value *startVal = start->codegen();
     if (!startVal)
         return nullptr;
-    Builder->CreateStore(startVal, alloca);
+    Builder->CreateStore(convertTo(startVal, doubleTy), alloca);
 
     llvm::BasicBlock *prevBB = Builder->GetInsertBlock();
     llvm::BasicBlock *loopBB =
@@ -278,6 +930,7 @@ llvm::Value *ForExprAST::codegen() {
         stepVal = step->codegen();
         if (!stepVal)
             return nullptr;
+        stepVal = convertTo(stepVal, doubleTy);
     } else {
         stepVal = llvm::ConstantFP::get(*Context, llvm::APFloat(1.0));
     }
@@ -291,14 +944,12 @@ llvm::Value *ForExprAST::codegen() {
     if (!endCond)
         return nullptr;
 
-    endCond = Builder->CreateFCmpONE(
-        endCond, llvm::ConstantFP::get(*Context, llvm::APFloat(0.0)),
-        "loopcond");
+    endCond = createIsTrue(endCond, "loopcond");
 
     llvm::BasicBlock *endBB = Builder->GetInsertBlock();
     llvm::BasicBlock *afterBB =
         llvm::BasicBlock::Create(*Context, "afterloop", function);
-    Builder->CreateCondBr(endCond, loopBB, afterBB);
+    addLoopHints(Builder->CreateCondBr(endCond, loopBB, afterBB));
     Builder->SetInsertPoint(afterBB);
 
     if (oldVal)
@@ -309,6 +960,21 @@ llvm::Value *ForExprAST::codegen() {
     return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*Context));
 }
 
+// The loop variable is always a double.
+void ForExprAST::forEachAssignment(const std::string &name,
+                                   AssignmentVisitor visit) {
+    start->forEachAssignment(name, visit);
+    if (varName == name)
+        return;
+
+    TypeScope scope;
+    scope.bind(varName, ValueType::Double);
+    end->forEachAssignment(name, visit);
+    if (step)
+        step->forEachAssignment(name, visit);
+    body->forEachAssignment(name, visit);
+}
+
 llvm::raw_ostream &ForExprAST::dump(llvm::raw_ostream &out, int ind) {
     ExprAST::dump(out << "for", ind);
     start->dump(indent(out, ind) << "cond:", ind + 1);
@@ -318,26 +984,128 @@ llvm::raw_ostream &ForExprAST::dump(llvm::raw_ostream &out, int ind) {
     return out;
 }
 
-VarExprAST::VarExprAST(std::vector<VarNamePair> varNames,
+VarExprAST::VarExprAST(std::vector<VarBinding> varNames,
                        std::unique_ptr<ExprAST> body)
-    : varNames(std::move(varNames)), body(std::move(body)) {}
+    : varNames(std::move(varNames)), body(std::move(body)) {
+    size_t bytes = sizeof(*this) + heapBytes(this->varNames);
+    for (auto &binding : this->varNames)
+        bytes += heapBytes(binding.name);
+    countAstNode(AstNode::Var, bytes);
+}
+
+// An unannotated binding is an int if its initializer is an int or an int
+// literal (a missing one is int 0), and so is every value assigned to it.
+// Bindings are assumed to be ints until an assignment proves otherwise,
+// repeating until nothing changes, so counters that only ever feed each
+// other stay ints. Ints wrap where doubles only lose precision, so a binding
+// also has to be opted in: some value it gets must depend on an annotated
+// int, or on a binding that is opted in already. Literals alone keep it a
+// double.
+std::vector<ValueType> VarExprAST::inferBindingTypes() {
+    unsigned n = varNames.size();
+    std::vector<ValueType> types(n);
+    for (unsigned i = 0; i != n; i++)
+        types[i] = varNames[i].type.value_or(ValueType::Int);
+
+    // Whether binding i is still the one its name refers to by binding j
+    // (or by the body, when j is n).
+    auto visible = [&](unsigned i, unsigned j) {
+        for (unsigned k = i + 1; k < j; k++)
+            if (varNames[k].name == varNames[i].name)
+                return false;
+        return true;
+    };
+
+    bool changed = true;
+    while (changed) {
+        std::vector<bool> onlyInt(n, true);
+        TypeScope scope;
+        for (unsigned j = 0; j != n; j++) {
+            if (ExprAST *init = varNames[j].init.get()) {
+                if (init->getType() != ValueType::Int &&
+                    !init->getIntConstant())
+                    onlyInt[j] = false;
+                for (unsigned i = 0; i != j; i++)
+                    if (types[i] == ValueType::Int && visible(i, j) &&
+                        !assignsOnlyInts(*init, varNames[i].name))
+                        onlyInt[i] = false;
+            }
+            scope.bind(varNames[j].name, types[j]);
+        }
+        for (unsigned i = 0; i != n; i++)
+            if (types[i] == ValueType::Int && visible(i, n) &&
+                !assignsOnlyInts(*body, varNames[i].name))
+                onlyInt[i] = false;
+
+        changed = false;
+        for (unsigned i = 0; i != n; i++) {
+            if (!varNames[i].type && types[i] == ValueType::Int &&
+                !onlyInt[i]) {
+                types[i] = ValueType::Double;
+                changed = true;
+            }
+        }
+        if (changed)
+            continue;
+
+        std::vector<bool> optedIn(n);
+        for (unsigned i = 0; i != n; i++)
+            optedIn[i] = varNames[i].type.has_value();
+        auto optIn = [&](unsigned i) {
+            if (optedIn[i] || types[i] != ValueType::Int)
+                return false;
+            optedIn[i] = true;
+            return true;
+        };
+        bool grew = true;
+        while (grew) {
+            grew = false;
+            TypeScope scope;
+            for (unsigned j = 0; j != n; j++) {
+                if (ExprAST *init = varNames[j].init.get()) {
+                    if (init->usesIntVariables())
+                        grew |= optIn(j);
+                    for (unsigned i = 0; i != j; i++)
+                        if (visible(i, j) &&
+                            assignsIntVariables(*init, varNames[i].name))
+                            grew |= optIn(i);
+                }
+                scope.bind(varNames[j].name,
+                           optedIn[j] ? types[j] : ValueType::Double);
+            }
+            for (unsigned i = 0; i != n; i++)
+                if (visible(i, n) &&
+                    assignsIntVariables(*body, varNames[i].name))
+                    grew |= optIn(i);
+        }
+
+        for (unsigned i = 0; i != n; i++) {
+            if (types[i] == ValueType::Int && !optedIn[i]) {
+                types[i] = ValueType::Double;
+                changed = true;
+            }
+        }
+    }
+    return types;
+}
 
 llvm::Value *VarExprAST::codegen() {
     std::vector<llvm::AllocaInst *> oldBindings;
     llvm::Function *function = Builder->GetInsertBlock()->getParent();
+    std::vector<ValueType> types = inferBindingTypes();
 
     for (unsigned i = 0, e = varNames.size(); i != e; i++) {
-        const std::string &name = varNames[i].first;
-        ExprAST *init = varNames[i].second.get();
+        const std::string &name = varNames[i].name;
+        ExprAST *init = varNames[i].init.get();
+        llvm::Type *type = getLLVMType(types[i]);
 
         llvm::Value *initVal =
-            init ? init->codegen()
-                 : llvm::ConstantFP::get(*Context, llvm::APFloat(0.0));
+            init ? init->codegen() : llvm::Constant::getNullValue(type);
         if (!initVal)
             return nullptr;
 
-        llvm::AllocaInst *alloca = createEntryBlockAlloca(function, name);
-        Builder->CreateStore(initVal, alloca);
+        llvm::AllocaInst *alloca = createEntryBlockAlloca(function, name, type);
+        Builder->CreateStore(convertTo(initVal, type), alloca);
 
         oldBindings.push_back(NamedValues[name]);
         NamedValues[name] = alloca;
@@ -350,30 +1118,79 @@ llvm::Value *VarExprAST::codegen() {
     if (!bodyVal)
         return nullptr;
 
-    for (unsigned i = 0, e = varNames.size(); i != e; i++) {
-        NamedValues[varNames[i].first] = oldBindings[i];
+    for (unsigned i = varNames.size(); i-- != 0;) {
+        NamedValues[varNames[i].name] = oldBindings[i];
     }
 
     return bodyVal;
 }
 
+ValueType VarExprAST::getType() {
+    std::vector<ValueType> types = inferBindingTypes();
+    TypeScope scope;
+    for (unsigned i = 0, e = varNames.size(); i != e; i++)
+        scope.bind(varNames[i].name, types[i]);
+    return body->getType();
+}
+
+bool VarExprAST::usesIntVariables() {
+    std::vector<ValueType> types = inferBindingTypes();
+    TypeScope scope;
+    for (unsigned i = 0, e = varNames.size(); i != e; i++)
+        scope.bind(varNames[i].name, types[i]);
+    return body->usesIntVariables();
+}
+
+void VarExprAST::forEachAssignment(const std::string &name,
+                                   AssignmentVisitor visit) {
+    std::vector<ValueType> types = inferBindingTypes();
+    TypeScope scope;
+    for (unsigned i = 0, e = varNames.size(); i != e; i++) {
+        if (varNames[i].init)
+            varNames[i].init->forEachAssignment(name, visit);
+        if (varNames[i].name == name)
+            return;
+        scope.bind(varNames[i].name, types[i]);
+    }
+    body->forEachAssignment(name, visit);
+}
+
 llvm::raw_ostream &VarExprAST::dump(llvm::raw_ostream &out, int ind) {
     ExprAST::dump(out << "var", ind);
-    for (const auto &var : varNames)
-        var.second->dump(indent(out, ind) << var.first << ':', ind + 1);
+    for (const auto &var : varNames) {
+        indent(out, ind) << var.name << ':';
+        if (var.init)
+            var.init->dump(out, ind + 1);
+        else
+            out << "0\n";
+    }
     body->dump(indent(out, ind) << "body:", ind + 1);
     return out;
 }
 
 PrototypeAST::PrototypeAST(const std::string &name,
-                           std::vector<std::string> args, bool isOperator,
+                           std::vector<std::string> args,
+                           std::vector<ValueType> argTypes, bool isOperator,
                            unsigned precedence)
-    : name(name), args(args), isOperator(isOperator), precedence(precedence) {}
+    : name(name), args(args), argTypes(std::move(argTypes)),
+      isOperator(isOperator), precedence(precedence) {
+    this->argTypes.resize(this->args.size(), ValueType::Double);
+
+    size_t bytes = sizeof(*this) + heapBytes(this->name) +
+                   heapBytes(this->args) + heapBytes(this->argTypes);
+    for (auto &arg : this->args)
+        bytes += heapBytes(arg);
+    countAstNode(AstNode::Prototype, bytes);
+}
 
 const std::string &PrototypeAST::getName() const { return name; }
 
 const std::vector<std::string> &PrototypeAST::getArgs() { return args; }
 
+const std::vector<ValueType> &PrototypeAST::getArgTypes() const {
+    return argTypes;
+}
+
 bool PrototypeAST::isUnaryOp() const { return isOperator && args.size() == 1; }
 
 bool PrototypeAST::isBinaryOp() const { return isOperator && args.size() == 2; }
@@ -386,10 +1203,11 @@ char PrototypeAST::getOperatorName() const {
 unsigned PrototypeAST::getBinaryPrecedence() const { return precedence; }
 
 llvm::Function *PrototypeAST::codegen() {
-    std::vector<llvm::Type *> doubles(args.size(),
-                                      llvm::Type::getDoubleTy(*Context));
+    std::vector<llvm::Type *> types;
+    for (ValueType type : argTypes)
+        types.push_back(getLLVMType(type));
     llvm::FunctionType *ft = llvm::FunctionType::get(
-        llvm::Type::getDoubleTy(*Context), doubles, false);
+        llvm::Type::getDoubleTy(*Context), types, false);
 
     llvm::Function *f = llvm::Function::Create(
         ft, llvm::Function::ExternalLinkage, name, Module.get());
@@ -401,31 +1219,20 @@ llvm::Function *PrototypeAST::codegen() {
     return f;
 }
 
-FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> proto,
-                         std::unique_ptr<ExprAST> body)
-    : proto(std::move(proto)), body(std::move(body)) {}
-
-llvm::Function *FunctionAST::codegen() {
-    auto &p = *proto;
-    functionProtos[proto->getName()] = std::move(proto);
-    llvm::Function *f = getFunction(p.getName());
-    if (!f)
-        return nullptr;
-
-    auto newArgs = p.getArgs();
-    if (f->arg_size() != newArgs.size())
-        return (llvm::Function *)LogErrorV(
-            "function cannot be redefined with different # args");
-
-    if (!f->empty())
-        return (llvm::Function *)LogErrorV("function cannot be redefined");
-
-    auto argIter = f->arg_begin();
-    for (unsigned i = 0; i != newArgs.size(); ++i, ++argIter)
-        argIter->setName(newArgs[i]);
-
-    if (p.isBinaryOp())
-        binopPrecedence[p.getOperatorName()] = p.getBinaryPrecedence();
+// Emits body into f, which must be empty. Returns false, leaving f's body
+// half-built, if the body has errors.
+bool emitFunctionBody(llvm::Function *f, PrototypeAST &p, ExprAST &body,
+                      bool fastMath) {
+    // Flags on the instructions let the IR passes reassociate and
+    // contract; the attributes relax codegen for the whole function.
+    llvm::IRBuilderBase::FastMathFlagGuard fmfGuard(*Builder);
+    if (fastMath || options.fastMath) {
+        Builder->setFastMathFlags(llvm::FastMathFlags::getFast());
+        for (const char *attr :
+             {"unsafe-fp-math", "no-nans-fp-math", "no-infs-fp-math",
+              "no-signed-zeros-fp-math", "approx-func-fp-math"})
+            f->addFnAttr(attr, "true");
+    }
 
     llvm::BasicBlock *bb = llvm::BasicBlock::Create(*Context, "entry", f);
     Builder->SetInsertPoint(bb);
@@ -438,11 +1245,11 @@ llvm::Function *FunctionAST::codegen() {
                                     ksDbgInfo.cu->getDirectory());
 
         llvm::DIScope *fContext = unit;
-        lineNo = 0;
-        unsigned scopeLine = 0;
+        lineNo = body.getLine();
+        unsigned scopeLine = lineNo;
         sp = dbuilder->createFunction(
             fContext, p.getName(), llvm::StringRef(), unit, lineNo,
-            createFunctionType(f->arg_size()), scopeLine,
+            createFunctionType(p.getArgTypes()), scopeLine,
             llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
         f->setSubprogram(sp);
 
@@ -450,15 +1257,20 @@ llvm::Function *FunctionAST::codegen() {
         ksDbgInfo.emitLocation(nullptr);
     }
 
+    // Value names may be discarded, so key variables by the prototype's
+    // argument names rather than the IR's.
+    const std::vector<std::string> &argNames = p.getArgs();
     NamedValues.clear();
     unsigned argIdx = 0;
     for (auto &arg : f->args()) {
-        llvm::AllocaInst *alloca = createEntryBlockAlloca(f, arg.getName());
+        const std::string &name = argNames[argIdx++];
+        llvm::AllocaInst *alloca =
+            createEntryBlockAlloca(f, name, arg.getType());
 
-        if (debug) {
+        if (debugLevel == DebugLevel::Full) {
             llvm::DILocalVariable *d = dbuilder->createParameterVariable(
-                sp, arg.getName(), ++argIdx, unit, lineNo,
-                ksDbgInfo.getDoubleTy(), true);
+                sp, name, argIdx, unit, lineNo,
+                ksDbgInfo.getType(p.getArgTypes()[argIdx - 1]), true);
             dbuilder->insertDeclare(
                 alloca, d, dbuilder->createExpression(),
                 llvm::DILocation::get(sp->getContext(), lineNo, 0, sp),
@@ -466,31 +1278,104 @@ llvm::Function *FunctionAST::codegen() {
         }
 
         Builder->CreateStore(&arg, alloca);
-        NamedValues[std::string(arg.getName())] = alloca;
+        NamedValues[name] = alloca;
     }
 
-    ksDbgInfo.emitLocation(body.get());
+    if (debug)
+        ksDbgInfo.emitLocation(&body);
+
+    llvm::Value *retVal = body.codegen();
+    if (retVal)
+        Builder->CreateRet(convertTo(retVal, getLLVMType(ValueType::Double)));
+
+    if (debug)
+        ksDbgInfo.lexicalBlocks.pop_back();
+
+    if (!retVal)
+        return false;
+
+    llvm::verifyFunction(*f);
+    if (jit)
+        inlineOperatorCalls(*f);
+    return true;
+}
+
+FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> proto,
+                         std::unique_ptr<ExprAST> body, bool fastMath)
+    : proto(std::move(proto)), body(std::move(body)), fastMath(fastMath) {
+    countAstNode(AstNode::Function, sizeof(*this));
+}
+
+// Only valid before codegen, which hands the prototype to functionProtos.
+const std::string &FunctionAST::getName() const { return proto->getName(); }
+
+llvm::Function *FunctionAST::codegen() {
+    PhaseScope phase(Phase::Codegen);
+
+    // A JIT'd function can be redefined, but its callers were compiled
+    // against its old signature.
+    auto existing = functionProtos.find(proto->getName());
+    if (jit && existing != functionProtos.end() &&
+        existing->second->getArgTypes() != proto->getArgTypes())
+        return (llvm::Function *)LogErrorV(
+            "function cannot be redefined with different arg types");
+
+    auto &p = *proto;
+    functionProtos[proto->getName()] = std::move(proto);
+    llvm::Function *f = getFunction(p.getName());
+    if (!f)
+        return nullptr;
+
+    auto newArgs = p.getArgs();
+    if (f->arg_size() != newArgs.size())
+        return (llvm::Function *)LogErrorV(
+            "function cannot be redefined with different # args");
+    for (unsigned i = 0; i != newArgs.size(); i++)
+        if (f->getArg(i)->getType() != getLLVMType(p.getArgTypes()[i]))
+            return (llvm::Function *)LogErrorV(
+                "function cannot be redefined with different arg types");
 
-    if (llvm::Value *retVal = body->codegen()) {
-        Builder->CreateRet(retVal);
+    if (!f->empty() || flushedFunctions.count(p.getName()))
+        return (llvm::Function *)LogErrorV("function cannot be redefined");
 
-        if (debug)
-            ksDbgInfo.lexicalBlocks.pop_back();
+    auto argIter = f->arg_begin();
+    for (unsigned i = 0; i != newArgs.size(); ++i, ++argIter)
+        argIter->setName(newArgs[i]);
 
-        llvm::verifyFunction(*f);
-        if (jit)
+    // A builtin like `:` can be redefined, so remember its precedence in case
+    // the body fails.
+    std::optional<int> oldPrecedence;
+    if (p.isBinaryOp()) {
+        auto it = binopPrecedence.find(p.getOperatorName());
+        if (it != binopPrecedence.end())
+            oldPrecedence = it->second;
+        binopPrecedence[p.getOperatorName()] = p.getBinaryPrecedence();
+    }
+
+    bool isOperator = p.isUnaryOp() || p.isBinaryOp();
+    if (isOperator)
+        f->addFnAttr(llvm::Attribute::AlwaysInline);
+
+    if (emitFunctionBody(f, p, *body, fastMath)) {
+        recordIRBeforePasses(*f);
+        // With --async-defs the JIT thread compiling the module runs them.
+        if (jit && !options.asyncDefs) {
+            PhaseScope phase(Phase::FunctionPasses);
             fpm->run(*f, *fam);
+            recordIRAfterPasses(*f);
+        }
+        if (isOperator)
+            operatorDefs[p.getName()] = {std::move(body), fastMath};
         return f;
     }
 
     // error reading body
     f->eraseFromParent();
 
-    if (p.isBinaryOp())
-        binopPrecedence.erase(proto->getOperatorName());
-
-    if (debug)
-        ksDbgInfo.lexicalBlocks.pop_back();
+    if (oldPrecedence)
+        binopPrecedence[p.getOperatorName()] = *oldPrecedence;
+    else if (p.isBinaryOp())
+        binopPrecedence.erase(p.getOperatorName());
 
     return nullptr;
 }
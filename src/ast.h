@@ -3,9 +3,11 @@
 #include <llvm/Support/raw_ostream.h>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
@@ -17,15 +19,43 @@
 
 #include "debug.h"
 
-extern std::unordered_map<char, int> binopPrecedence;
+// Keyed by token: an ASCII operator, or tok_and/tok_or.
+extern std::unordered_map<int, int> binopPrecedence;
+extern std::string *deferredErrors;
+// Errors reported so far.
+extern unsigned errorCount;
 
 llvm::Value *LogErrorV(const char *str);
 
+// Every value is a double unless it's annotated or provably an int. Function
+// results, and the arguments and results of externs, are always doubles, so
+// the C ABI of the runtime is unchanged.
+enum class ValueType { Double, Int };
+
+class ExprAST;
+struct MathBuiltin;
+using AssignmentVisitor = llvm::function_ref<void(ExprAST &value)>;
+
 class ExprAST {
     public:
         ExprAST(SourceLocation loc = curLoc);
         virtual ~ExprAST() = default;
         virtual llvm::Value *codegen() = 0;
+        // The type codegen will produce, given the variables in scope.
+        virtual ValueType getType();
+        // Calls visit with the value of every assignment in this expression
+        // to the variable name (as bound outside this expression).
+        virtual void forEachAssignment(const std::string &name,
+                                       AssignmentVisitor visit);
+        // Whether the value depends on a variable that holds an int, given
+        // the variables in scope, rather than only on int literals.
+        virtual bool usesIntVariables();
+        // The value of this expression if it's an int literal.
+        virtual std::optional<int64_t> getIntConstant();
+        // The variable this expression reads, if it's a variable reference.
+        virtual const std::string *getVariableName();
+        // The bound of this expression if it's `name < bound`.
+        virtual ExprAST *getUpperBound(const std::string &name);
         int getLine() const;
         int getCol() const;
         virtual llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind);
@@ -36,18 +66,24 @@ class ExprAST {
 
 class NumberExprAST : public ExprAST {
     public:
-        NumberExprAST(double val);
+        NumberExprAST(double val, bool isInt = false);
         llvm::Value *codegen() override;
+        ValueType getType() override;
+        std::optional<int64_t> getIntConstant() override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
         double val;
+        bool isInt;
 };
 
 class VariableExprAST : public ExprAST {
     public:
         VariableExprAST(SourceLocation loc, const std::string &name);
         llvm::Value *codegen() override;
+        ValueType getType() override;
+        bool usesIntVariables() override;
+        const std::string *getVariableName() override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
         const std::string getName();
 
@@ -57,14 +93,22 @@ class VariableExprAST : public ExprAST {
 
 class BinaryExprAST : public ExprAST {
     public:
-        BinaryExprAST(SourceLocation loc, char op,
+        BinaryExprAST(SourceLocation loc, int op,
                       std::unique_ptr<ExprAST> left,
                       std::unique_ptr<ExprAST> right);
         llvm::Value *codegen() override;
+        ValueType getType() override;
+        bool usesIntVariables() override;
+        void forEachAssignment(const std::string &name,
+                               AssignmentVisitor visit) override;
+        ExprAST *getUpperBound(const std::string &name) override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
-        char op;
+        llvm::Value *codegenLogical();
+
+        // An ASCII operator, or tok_and/tok_or.
+        int op;
         std::unique_ptr<ExprAST> left, right;
 };
 
@@ -72,6 +116,10 @@ class UnaryExprAST : public ExprAST {
     public:
         UnaryExprAST(char op, std::unique_ptr<ExprAST> operand);
         llvm::Value *codegen() override;
+        ValueType getType() override;
+        bool usesIntVariables() override;
+        void forEachAssignment(const std::string &name,
+                               AssignmentVisitor visit) override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
@@ -84,9 +132,14 @@ class CallExprAST : public ExprAST {
         CallExprAST(SourceLocation loc, const std::string &callee,
                     std::vector<std::unique_ptr<ExprAST>> args);
         llvm::Value *codegen() override;
+        void forEachAssignment(const std::string &name,
+                               AssignmentVisitor visit) override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
+        llvm::Value *codegenBuiltin(const MathBuiltin &builtin);
+        llvm::Value *codegenBench();
+
         std::string callee;
         std::vector<std::unique_ptr<ExprAST>> args;
 };
@@ -97,6 +150,10 @@ class IfExprAST : public ExprAST {
                   std::unique_ptr<ExprAST> tBranch,
                   std::unique_ptr<ExprAST> fBranch);
         llvm::Value *codegen() override;
+        ValueType getType() override;
+        bool usesIntVariables() override;
+        void forEachAssignment(const std::string &name,
+                               AssignmentVisitor visit) override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
@@ -105,39 +162,66 @@ class IfExprAST : public ExprAST {
         std::unique_ptr<ExprAST> fBranch;
 };
 
+// Annotations on a for loop, such as `unroll 4 vectorize 8`, passed to the
+// optimizer as llvm.loop metadata. A count of 0 means none was given.
+struct LoopHints {
+        bool unroll = false, vectorize = false;
+        unsigned unrollCount = 0, vectorizeWidth = 0, interleaveCount = 0;
+};
+
 class ForExprAST : public ExprAST {
     public:
         ForExprAST(std::string &varName, std::unique_ptr<ExprAST> start,
                    std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> step,
-                   std::unique_ptr<ExprAST> body);
+                   std::unique_ptr<ExprAST> body, LoopHints hints = {});
         llvm::Value *codegen() override;
+        void forEachAssignment(const std::string &name,
+                               AssignmentVisitor visit) override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
+        bool isCounted();
+        llvm::Value *codegenCounted();
+        void addLoopHints(llvm::Instruction *backedge);
+
         std::string varName;
         std::unique_ptr<ExprAST> start, end, step, body;
+        LoopHints hints;
 };
 
-using VarNamePair = std::pair<std::string, std::unique_ptr<ExprAST>>;
+struct VarBinding {
+        std::string name;
+        std::unique_ptr<ExprAST> init;
+        // Declared type, if the binding was annotated.
+        std::optional<ValueType> type;
+};
 
 class VarExprAST : public ExprAST {
     public:
-        VarExprAST(std::vector<VarNamePair> varNames,
+        VarExprAST(std::vector<VarBinding> varNames,
                    std::unique_ptr<ExprAST> body);
         llvm::Value *codegen() override;
+        ValueType getType() override;
+        bool usesIntVariables() override;
+        void forEachAssignment(const std::string &name,
+                               AssignmentVisitor visit) override;
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override;
 
     private:
-        std::vector<VarNamePair> varNames;
+        std::vector<ValueType> inferBindingTypes();
+
+        std::vector<VarBinding> varNames;
         std::unique_ptr<ExprAST> body;
 };
 
 class PrototypeAST {
     public:
         PrototypeAST(const std::string &name, std::vector<std::string> args,
+                     std::vector<ValueType> argTypes = {},
                      bool isOperator = false, unsigned precedence = 0);
         const std::string &getName() const;
         const std::vector<std::string> &getArgs();
+        const std::vector<ValueType> &getArgTypes() const;
         bool isUnaryOp() const;
         bool isBinaryOp() const;
         char getOperatorName() const;
@@ -147,6 +231,7 @@ class PrototypeAST {
     private:
         std::string name;
         std::vector<std::string> args;
+        std::vector<ValueType> argTypes;
         bool isOperator;
         unsigned precedence;
 };
@@ -154,11 +239,15 @@ class PrototypeAST {
 class FunctionAST {
     public:
         FunctionAST(std::unique_ptr<PrototypeAST> proto,
-                    std::unique_ptr<ExprAST> body);
+                    std::unique_ptr<ExprAST> body, bool fastMath = false);
+        const std::string &getName() const;
         llvm::Function *codegen();
         llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind);
 
     private:
         std::unique_ptr<PrototypeAST> proto;
         std::unique_ptr<ExprAST> body;
+        // Let LLVM reassociate, contract and otherwise treat FP math as
+        // real arithmetic in this function.
+        bool fastMath;
 };
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "cache.h"
+#include "debug.h"
+#include "llvm.h"
+#include "options.h"
+
+// Bump when the compiler's outputs change in a way the key doesn't cover.
+constexpr const char *cacheFormat = "kaleidoscope-cache-1";
+
+// What localCache names entries; pruning and the stats look for it too.
+constexpr const char *entryPrefix = "llvmcache-";
+
+std::string cacheKey(llvm::StringRef source, const char *fileName) {
+    llvm::SHA1 hasher;
+    auto add = [&](llvm::StringRef field) {
+        hasher.update(field);
+        hasher.update(llvm::StringRef("", 1));
+    };
+
+    add(cacheFormat);
+    add(LLVM_VERSION_STRING);
+
+    // A rebuilt compiler may generate different code from the same source.
+    llvm::sys::fs::file_status exe;
+    std::string exePath =
+        llvm::sys::fs::getMainExecutable(nullptr, (void *)&cacheKey);
+    if (!llvm::sys::fs::status(exePath, exe)) {
+        add(std::to_string(exe.getSize()));
+        add(std::to_string(
+            exe.getLastModificationTime().time_since_epoch().count()));
+    }
+
+    llvm::TargetMachine *targetMachine = getTargetMachine();
+    add(targetMachine->getTargetTriple().str());
+    add(targetMachine->getTargetCPU());
+    add(targetMachine->getTargetFeatureString());
+
+    add(debugLevel == DebugLevel::Full ? "O0" : "O2");
+    add(std::to_string((int)debugLevel));
+    // Debug info records the file's name.
+    add(debug ? fileName : "");
+    add(std::to_string(options.fastMath));
+    add(std::to_string(options.sampleProfile));
+
+    add(source);
+    return llvm::toHex(hasher.result(), true);
+}
+
+void reportCacheError(llvm::Error err) {
+    fprintf(stderr, "Error: cache: %s\n",
+            llvm::toString(std::move(err)).c_str());
+}
+
+bool writeFile(const std::string &file, llvm::StringRef contents) {
+    std::error_code ec;
+    llvm::raw_fd_ostream os(file, ec);
+    if (ec) {
+        fprintf(stderr, "Error: could not write %s: %s\n", file.c_str(),
+                ec.message().c_str());
+        return false;
+    }
+    os << contents;
+    return true;
+}
+
+bool cacheFetch(const std::string &key, const std::vector<std::string> &files) {
+    // A hit hands its entry to the callback, under the task number it was
+    // looked up with.
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> hits(files.size());
+    auto cache = llvm::localCache(
+        "kaleidoscope", "kaleidoscope-tmp", options.cacheDir,
+        [&](unsigned task, const llvm::Twine &,
+            std::unique_ptr<llvm::MemoryBuffer> buffer) {
+            hits[task] = std::move(buffer);
+        });
+    if (!cache) {
+        reportCacheError(cache.takeError());
+        return false;
+    }
+
+    for (unsigned i = 0; i != files.size(); i++) {
+        auto addStream = (*cache)(i, key + "-" + std::to_string(i), "");
+        if (!addStream) {
+            reportCacheError(addStream.takeError());
+            return false;
+        }
+        if (*addStream)
+            return false;
+    }
+
+    for (unsigned i = 0; i != files.size(); i++)
+        if (!writeFile(files[i], hits[i]->getBuffer()))
+            return false;
+    return true;
+}
+
+void cacheStore(const std::string &key, const std::vector<std::string> &files) {
+    auto cache = llvm::localCache(
+        "kaleidoscope", "kaleidoscope-tmp", options.cacheDir,
+        [](unsigned, const llvm::Twine &, std::unique_ptr<llvm::MemoryBuffer>) {
+        });
+    if (!cache)
+        return reportCacheError(cache.takeError());
+
+    for (unsigned i = 0; i != files.size(); i++) {
+        auto contents = llvm::MemoryBuffer::getFile(files[i]);
+        if (!contents)
+            return;
+
+        auto addStream = (*cache)(i, key + "-" + std::to_string(i), "");
+        if (!addStream)
+            return reportCacheError(addStream.takeError());
+        // Already there, perhaps from a concurrent compile.
+        if (!*addStream)
+            continue;
+
+        auto stream = (*addStream)(i, "");
+        if (!stream)
+            return reportCacheError(stream.takeError());
+        // The entry is renamed into place when the stream is destroyed.
+        *(*stream)->OS << (*contents)->getBuffer();
+    }
+
+    cachePrune();
+}
+
+llvm::FileCache cacheForLTO(const std::vector<std::string> &taskFiles) {
+    if (options.cacheDir.empty())
+        return nullptr;
+
+    auto cache = llvm::localCache(
+        "kaleidoscope", "kaleidoscope-tmp", options.cacheDir,
+        [&taskFiles](unsigned task, const llvm::Twine &,
+                     std::unique_ptr<llvm::MemoryBuffer> buffer) {
+            writeFile(taskFiles[task], buffer->getBuffer());
+        });
+    if (!cache) {
+        reportCacheError(cache.takeError());
+        return nullptr;
+    }
+    return *cache;
+}
+
+// Evicts the least recently used entries past options.cacheSize, and any
+// not used for a week.
+void cachePrune() {
+    llvm::CachePruningPolicy policy;
+    policy.Interval = std::chrono::seconds(0);
+    policy.MaxSizeBytes = options.cacheSize;
+    llvm::pruneCache(options.cacheDir, policy);
+}
+
+void printCacheStats(llvm::raw_ostream &out) {
+    uint64_t entries = 0, bytes = 0;
+    llvm::sys::TimePoint<> now = std::chrono::system_clock::now();
+    llvm::sys::TimePoint<> oldest = now, newest;
+
+    std::error_code ec;
+    for (llvm::sys::fs::directory_iterator it(options.cacheDir, ec), end;
+         it != end && !ec; it.increment(ec)) {
+        if (!llvm::sys::path::filename(it->path()).starts_with(entryPrefix))
+            continue;
+        auto status = it->status();
+        if (!status)
+            continue;
+        entries++;
+        bytes += status->getSize();
+        auto accessed = status->getLastAccessedTime();
+        oldest = std::min(oldest, accessed);
+        newest = std::max(newest, accessed);
+    }
+
+    auto hoursAgo = [&](llvm::sys::TimePoint<> t) {
+        return std::chrono::duration<double, std::ratio<3600>>(now - t)
+            .count();
+    };
+    out << "cache: " << options.cacheDir << "\n";
+    out << "  entries          " << entries << "\n";
+    out << llvm::format("  size             %.1fMB of %.1fMB\n",
+                        bytes / 1048576.0, options.cacheSize / 1048576.0);
+    if (entries) {
+        out << llvm::format("  least recent use %.1f hours ago\n",
+                            hoursAgo(oldest));
+        out << llvm::format("  most recent use  %.1f hours ago\n",
+                            hoursAgo(newest));
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Caching.h"
+#include "llvm/Support/raw_ostream.h"
+
+// A content-addressed cache of compiler outputs in options.cacheDir, shared
+// by every compiler process pointed at it. Entries are written to temporary
+// files and renamed into place, so a reader never sees half of one, and the
+// least recently used are evicted once the cache outgrows options.cacheSize.
+
+// A key covering everything compiling source depends on: its bytes, the
+// compiler binary and LLVM version, the target, and the options that change
+// the code generated.
+std::string cacheKey(llvm::StringRef source, const char *fileName);
+// Copies the outputs cached under key into files. Returns false, leaving
+// the files alone, unless every one of them was cached.
+bool cacheFetch(const std::string &key, const std::vector<std::string> &files);
+// Caches files under key, then evicts whatever no longer fits.
+void cacheStore(const std::string &key, const std::vector<std::string> &files);
+// A cache for the ThinLTO backends, which compute their own keys. Each
+// task's object, cached or not, is written to taskFiles[task].
+llvm::FileCache cacheForLTO(const std::vector<std::string> &taskFiles);
+void cachePrune();
+void printCacheStats(llvm::raw_ostream &out);
@@ -1,27 +1,135 @@
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include "cache.h"
 #include "debug.h"
 #include "lexer.h"
+#include "link.h"
 #include "llvm.h"
+#include "memReport.h"
+#include "options.h"
 #include "parser.h"
+#include "profiler.h"
+#include "stats.h"
 
 const std::string bitcodeOutFileName = "kaleidoscope.bc";
 const std::string objectOutFileName = "kaleidoscope.o";
+const std::string archiveOutFileName = "kaleidoscope.a";
+
+Options options;
+// Print the build cache's stats and exit.
+bool cacheStats = false;
+
+// Resolves JIT'd code through the JIT's own records, which carry source lines
+// when debug info is on, and everything else through the symbol table.
+bool resolveJITSymbol(uint64_t pc, ProfileSymbol *sym) {
+    JITCodeListener::FunctionEntry entry;
+    if (!codeListener->lookup(pc, entry))
+        return resolveNativeSymbol(pc, sym);
+
+    // Drop the JIT's version suffix (fib.3 is the third definition of fib).
+    std::string name = entry.name.substr(0, entry.name.find('.'));
+    snprintf(sym->name, sizeof(sym->name), "%s", name.c_str());
+    for (auto &line : entry.lines) {
+        if (line.addr > pc)
+            break;
+        snprintf(sym->file, sizeof(sym->file), "%s", line.file.c_str());
+        sym->line = line.line;
+    }
+    return true;
+}
+
+// Prints the --mem-report and writes its JSON version.
+void finishMemReport() {
+    printMemReport(llvm::errs());
+    writeMemReportJSON(memReportFileName);
+}
 
 void runInteractive() {
     Lexer lexer(stdin);
     Parser parser(lexer);
 
+    if (options.timeReport || options.memReport)
+        startPhaseTiming();
+
     fprintf(stderr, "kaleidoscope> ");
     parser.getNextToken();
 
-    initializeModule();
+    initializeContext();
     initializeJIT();
+    initializeModule();
+    if (options.sampleProfile &&
+        !profilerStart(options.sampleProfile, resolveJITSymbol))
+        fprintf(stderr, "Error: could not start the sampling profiler\n");
     parser.run();
     fprintf(stderr, "\n");
+
+    if (options.sampleProfile) {
+        profilerStop();
+        profilerReport(stderr, collapsedStacksFileName);
+    }
+
+    if (options.latencyHistogram)
+        parser.printLatencyReport(llvm::errs());
+
+    if (options.jitStats)
+        jit->printStats(llvm::errs());
+
+    if (options.timeReport)
+        printTimeReport(llvm::errs(), lexer.getLineCount());
+
+    if (options.memReport)
+        finishMemReport();
+}
+
+// Finishes the current module and runs the module pipeline over it.
+void finishModule() {
+    if (debug)
+        debugFinalize();
+
+    if (options.sampleProfile)
+        prepareForProfiling();
+
+    if (debugLevel != DebugLevel::Full)
+        runModulePasses();
 }
 
 void runFileInput(char *inFileName) {
+    if (options.timeReport || options.memReport)
+        startPhaseTiming();
+
+    // A cache hit skips everything from lexing on. Streamed and parallel
+    // compiles write a varying set of objects, so they aren't cached.
+    std::string key;
+    std::vector<std::string> outputs = {bitcodeOutFileName,
+                                        objectOutFileName};
+    if (!options.cacheDir.empty() && !options.streamChunk &&
+        options.codegenThreads <= 1) {
+        if (auto source = llvm::MemoryBuffer::getFile(inFileName)) {
+            key = cacheKey((*source)->getBuffer(), inFileName);
+            if (cacheFetch(key, outputs)) {
+                if (options.timeReport)
+                    printTimeReport(llvm::errs(), 0);
+                if (options.memReport)
+                    finishMemReport();
+                return;
+            }
+        }
+    }
+
+    initializeContext();
     initializeModule();
 
     auto *inFile = fopen(inFileName, "r");
@@ -32,37 +140,402 @@ void runFileInput(char *inFileName) {
     Parser parser(lexer);
 
     if (debug)
-        debugSetup();
+        debugSetup(inFileName);
 
     parser.getNextToken();
 
-    parser.parseStream();
+    // Output split across several objects goes out as one archive.
+    std::vector<std::string> objects;
+    auto emitObjects = [&](const std::string &stem) {
+        if (options.codegenThreads > 1)
+            writeObjectsParallel(stem, options.codegenThreads, objects);
+        else {
+            objects.push_back(stem + ".o");
+            writeObject(objects.back().c_str());
+        }
+    };
 
-    fclose(inFile);
+    if (!options.streamChunk) {
+        parser.parseStream();
+        fclose(inFile);
 
-    if (!debug)
-        runModulePasses();
+        finishModule();
+
+        writeToBitcode(bitcodeOutFileName.c_str());
+
+        if (options.codegenThreads > 1)
+            emitObjects("kaleidoscope");
+        else
+            writeObject(objectOutFileName.c_str());
+
+        // Errors aren't reported again on a hit, so only clean compiles are
+        // cached.
+        if (!key.empty() && !errorCount)
+            cacheStore(key, outputs);
+    } else {
+        // Each chunk is optimized on its own, so calls between chunks aren't
+        // inlined, and there is no whole-program bitcode to write.
+        unsigned chunks = 0;
+        auto emitChunk = [&] {
+            finishModule();
+            emitObjects("kaleidoscope." + std::to_string(chunks++));
+        };
+
+        unsigned defined = 0;
+        parser.parseStream([&] {
+            if (++defined < options.streamChunk)
+                return;
+            emitChunk();
+            startNextChunk();
+            if (debug)
+                debugSetup(inFileName);
+            defined = 0;
+        });
+        fclose(inFile);
+
+        // Whatever is left, including top-level expressions and externs
+        // since the last full chunk.
+        emitChunk();
+
+        llvm::sys::fs::remove(bitcodeOutFileName);
+    }
 
-    writeToBitcode(bitcodeOutFileName.c_str());
+    if (!objects.empty()) {
+        // Don't leave a single-object compile's output around to be mistaken
+        // for this one's.
+        llvm::sys::fs::remove(objectOutFileName);
+        writeObjectArchive(archiveOutFileName.c_str(), objects);
+    }
+
+    if (options.timeReport)
+        printTimeReport(llvm::errs(), lexer.getLineCount());
+
+    if (options.memReport)
+        finishMemReport();
+}
+
+// Compiles one of several inputs to bitcode for linkThinLTO.
+bool compileForLink(const char *inFileName, const char *bitcodeFileName) {
+    initializeContext();
+    initializeModule();
+
+    auto *inFile = fopen(inFileName, "r");
+    if (!inFile) {
+        fprintf(stderr, "Error: file open failed: %s\n", inFileName);
+        return false;
+    }
+
+    Lexer lexer(inFile);
+    Parser parser(lexer);
 
-    if (debug) {
+    if (debug)
+        debugSetup(inFileName);
+
+    parser.getNextToken();
+    parser.parseStream();
+    fclose(inFile);
+
+    if (debug)
         debugFinalize();
+
+    if (options.sampleProfile)
+        prepareForProfiling();
+
+    writeThinLTOBitcode(bitcodeFileName);
+    return true;
+}
+
+// Next to each file's bitcode, the build cache's key for the compile that
+// wrote it, which covers the source, the compiler, the target and the
+// options that change the code generated.
+std::string stampFileName(const std::string &bitcodeFile) {
+    return bitcodeFile + ".stamp";
+}
+
+// The key for compiling src, or "" if it can't be read.
+std::string compileKey(const char *src) {
+    auto source = llvm::MemoryBuffer::getFile(src);
+    if (!source)
+        return "";
+    return cacheKey((*source)->getBuffer(), src);
+}
+
+// Whether file exists and was written by a compile with this key.
+bool isUpToDate(const std::string &file, const std::string &key) {
+    if (key.empty() || !llvm::sys::fs::exists(file))
+        return false;
+    auto stamp = llvm::MemoryBuffer::getFile(stampFileName(file));
+    return stamp && (*stamp)->getBuffer() == key;
+}
+
+// A stamp that can't be written only costs a recompile next time.
+void writeStamp(const std::string &file, const std::string &key) {
+    std::error_code ec;
+    llvm::raw_fd_ostream os(stampFileName(file), ec);
+    if (!ec)
+        os << key;
+}
+
+// Builds a program from several files, each its own compile unit. Every
+// file is compiled to <stem>.bc, with a ThinLTO summary, in a child process
+// of its own: the compiler's state is global, and this way up to --jobs
+// files compile at once. A file whose bitcode is stamped with the key of
+// the compile it would get is left alone. Functions from other files are
+// declared with extern. The thin link then imports across files and
+// generates code in parallel, and the objects are archived like a streamed
+// compile's.
+bool runFiles(const std::vector<char *> &inputs) {
+    auto start = StatClock::now();
+    unsigned jobs = options.jobs;
+    if (!jobs)
+        jobs = std::max(std::thread::hardware_concurrency(), 1u);
+
+    std::vector<std::string> bitcodeFiles;
+    for (auto *input : inputs) {
+        bitcodeFiles.push_back(llvm::sys::path::stem(input).str() + ".bc");
+        for (size_t i = 0; i + 1 < bitcodeFiles.size(); i++)
+            if (bitcodeFiles[i] == bitcodeFiles.back()) {
+                fprintf(stderr, "Error: %s and %s would both compile to %s\n",
+                        inputs[i], input, bitcodeFiles[i].c_str());
+                return false;
+            }
     }
 
-    writeObject(objectOutFileName.c_str());
+    // Children inherit unflushed output, which they would print again.
+    fflush(nullptr);
+
+    std::vector<StatClock::time_point> started(inputs.size());
+    std::vector<StatClock::duration> times(inputs.size());
+    std::vector<bool> compiled(inputs.size());
+    std::map<pid_t, size_t> running;
+    bool ok = true;
+    auto reap = [&] {
+        int status;
+        pid_t pid = wait(&status);
+        size_t i = running[pid];
+        running.erase(pid);
+        times[i] = StatClock::now() - started[i];
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "Error: compiling %s failed\n", inputs[i]);
+            ok = false;
+        }
+    };
+
+    for (size_t i = 0; i != inputs.size(); i++) {
+        std::string key = compileKey(inputs[i]);
+        if (isUpToDate(bitcodeFiles[i], key))
+            continue;
+        if (running.size() == jobs)
+            reap();
+
+        compiled[i] = true;
+        started[i] = StatClock::now();
+        pid_t pid = fork();
+        if (!pid) {
+            // A compile that dies part way mustn't leave bitcode that looks
+            // up to date.
+            std::string tmp = bitcodeFiles[i] + ".tmp";
+            bool written = compileForLink(inputs[i], tmp.c_str()) &&
+                           !llvm::sys::fs::rename(tmp, bitcodeFiles[i]);
+            if (written && !key.empty())
+                writeStamp(bitcodeFiles[i], key);
+            fflush(nullptr);
+            _exit(written ? 0 : 1);
+        }
+        if (pid < 0) {
+            perror("Error: fork");
+            ok = false;
+            break;
+        }
+        running[pid] = i;
+    }
+    while (!running.empty())
+        reap();
+    if (!ok)
+        return false;
+
+    auto linkStart = StatClock::now();
+    std::vector<std::string> objects;
+    if (!linkThinLTO(bitcodeFiles, jobs, objects))
+        return false;
+
+    // Don't leave a single-file compile's outputs around to be mistaken for
+    // this one's.
+    llvm::sys::fs::remove(bitcodeOutFileName);
+    llvm::sys::fs::remove(objectOutFileName);
+    writeObjectArchive(archiveOutFileName.c_str(), objects);
+
+    if (options.timeReport) {
+        auto seconds = [](StatClock::duration d) {
+            return std::chrono::duration<double>(d).count();
+        };
+        size_t numCompiled = std::count(compiled.begin(), compiled.end(), true);
+        fprintf(stderr, "build report: %zu files, %zu compiled, %u jobs\n",
+                inputs.size(), numCompiled, jobs);
+        for (size_t i = 0; i != inputs.size(); i++) {
+            if (compiled[i])
+                fprintf(stderr, "  %-32s %10.4fs\n", inputs[i],
+                        seconds(times[i]));
+            else
+                fprintf(stderr, "  %-32s %11s\n", inputs[i], "up to date");
+        }
+        fprintf(stderr, "  %-32s %10.4fs\n", "compile (wall)",
+                seconds(linkStart - start));
+        fprintf(stderr, "  %-32s %10.4fs\n", "thin link and codegen",
+                seconds(StatClock::now() - linkStart));
+        fprintf(stderr, "  %-32s %10.4fs\n", "total",
+                seconds(StatClock::now() - start));
+    }
+    return true;
+}
+
+// Parses a byte count with an optional K, M or G suffix.
+bool parseSize(const char *str, size_t &out) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+    switch (*end) {
+        case 'G':
+            val <<= 10;
+            [[fallthrough]];
+        case 'M':
+            val <<= 10;
+            [[fallthrough]];
+        case 'K':
+            val <<= 10;
+            end++;
+            break;
+    }
+    out = val;
+    return !*end;
+}
+
+// Returns false if arg is not a recognized option.
+bool parseOption(const char *arg) {
+    if (!strcmp(arg, "--latency-histogram"))
+        options.latencyHistogram = true;
+    else if (!strcmp(arg, "--batch"))
+        options.batchExprs = true;
+    else if (!strcmp(arg, "--async-defs"))
+        options.asyncDefs = true;
+    else if (!strcmp(arg, "-g"))
+        setDebugLevel(DebugLevel::Full);
+    else if (!strcmp(arg, "-gline-tables-only"))
+        setDebugLevel(DebugLevel::LineTablesOnly);
+    else if (!strcmp(arg, "-g0"))
+        setDebugLevel(DebugLevel::None);
+    else if (!strcmp(arg, "--no-batch"))
+        options.batchExprs = false;
+    else if (!strcmp(arg, "--no-jit-slabs"))
+        options.jitSlabs = false;
+    else if (!strcmp(arg, "--jit-huge-pages"))
+        options.jitHugePages = true;
+    else if (!strcmp(arg, "--jit-stats"))
+        options.jitStats = true;
+    else if (!strcmp(arg, "--perf-map"))
+        options.perfMap = true;
+    else if (!strcmp(arg, "--jitdump"))
+        options.jitdump = true;
+    else if (!strcmp(arg, "--fast-math"))
+        options.fastMath = true;
+    else if (!strcmp(arg, "--loop-remarks"))
+        options.loopRemarks = true;
+    else if (!strcmp(arg, "--time-report"))
+        options.timeReport = true;
+    else if (!strcmp(arg, "--mem-report"))
+        options.memReport = true;
+    else if (!strcmp(arg, "--stream"))
+        options.streamChunk = 256;
+    else if (!strncmp(arg, "--stream=", 9)) {
+        char *end;
+        options.streamChunk = strtoul(arg + 9, &end, 10);
+        return end != arg + 9 && !*end && options.streamChunk;
+    } else if (!strcmp(arg, "--codegen-threads"))
+        options.codegenThreads = std::thread::hardware_concurrency();
+    else if (!strncmp(arg, "--codegen-threads=", 18)) {
+        char *end;
+        options.codegenThreads = strtoul(arg + 18, &end, 10);
+        return end != arg + 18 && !*end && options.codegenThreads;
+    } else if (!strncmp(arg, "--jobs=", 7)) {
+        char *end;
+        options.jobs = strtoul(arg + 7, &end, 10);
+        return end != arg + 7 && !*end;
+    } else if (!strncmp(arg, "--cache-dir=", 12))
+        options.cacheDir = arg + 12;
+    else if (!strncmp(arg, "--cache-size=", 13))
+        return parseSize(arg + 13, options.cacheSize);
+    else if (!strcmp(arg, "--cache-stats"))
+        cacheStats = true;
+    else if (!strcmp(arg, "--sample-profile"))
+        options.sampleProfile = 1000;
+    else if (!strncmp(arg, "--sample-profile=", 17)) {
+        char *end;
+        options.sampleProfile = strtoul(arg + 17, &end, 10);
+        return end != arg + 17 && !*end && options.sampleProfile;
+    } else if (!strncmp(arg, "--jit-memory-budget=", 20))
+        return parseSize(arg + 20, options.jitMemoryBudget);
+    else
+        return false;
+    return true;
 }
 
 int main(int argc, char **argv) {
-    switch (argc) {
+    options.batchExprs = !isatty(fileno(stdin));
+
+    // Where -o puts a linked executable.
+    const char *exeOutFileName = nullptr;
+
+    std::vector<char *> inputs;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc) {
+                fprintf(stderr, "Error: -o needs a file name\n");
+                return 1;
+            }
+            exeOutFileName = argv[i];
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            if (!parseOption(argv[i])) {
+                fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+        } else
+            inputs.push_back(argv[i]);
+    }
+
+    if (cacheStats) {
+        if (options.cacheDir.empty()) {
+            fprintf(stderr, "Error: --cache-stats needs --cache-dir\n");
+            return 1;
+        }
+        printCacheStats(llvm::outs());
+        return 0;
+    }
+
+    if (exeOutFileName && inputs.empty()) {
+        fprintf(stderr, "Error: -o needs an input file\n");
+        return 1;
+    }
+
+    switch (inputs.size()) {
         case 0:
-        case 1:
             runInteractive();
             break;
-        case 2:
-            runFileInput(argv[1]);
+        case 1:
+            runFileInput(inputs[0]);
             break;
         default:
-            fprintf(stderr, "Error: too many args (max 1)");
+            if (!runFiles(inputs))
+                return 1;
+            break;
+    }
+
+    // Split and multi-file compiles leave an archive instead of an object.
+    if (exeOutFileName) {
+        const std::string &object = llvm::sys::fs::exists(objectOutFileName)
+                                        ? objectOutFileName
+                                        : archiveOutFileName;
+        if (!linkExecutable(object, exeOutFileName))
             return 1;
     }
     return 0;
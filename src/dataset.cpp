@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "runtime.h"
+
+// Numeric datasets for batch programs. Kaleidoscope has no strings, so files
+// are named through the environment: dataopen(n) and datacreate(n) use the
+// path in $KALEIDOSCOPE_FILE<n>. A name ending in .csv or .txt is text,
+// with numbers separated by commas and whitespace and anything else (a
+// header, say) skipped; any other file is raw native-endian doubles.
+//
+// Input files are memory-mapped, so nothing is copied. Binary files can be
+// read by index in constant time. Text is parsed as it is read, and reading
+// it by index is only cheap going forwards, since going backwards rescans
+// from the start. Output goes through a large stdio buffer.
+//
+// No std containers or operator new below: like profiler.cpp, this file is
+// linked into compiled programs by the C driver, without libstdc++.
+
+namespace {
+
+struct Dataset {
+        bool used = false;
+        bool text = false;
+
+        // Input: the mapping, and for text, where the cursor is and the
+        // index of the value it is at. count is SIZE_MAX for text until the
+        // values have been counted.
+        const char *data = nullptr;
+        size_t size = 0;
+        size_t pos = 0;
+        size_t index = 0;
+        size_t count = 0;
+        // A text value parsed by dataeof but not yet read.
+        bool peeked = false;
+        double peekValue = 0;
+        size_t peekEnd = 0;
+
+        // Output, and whether the current text row has a value yet.
+        FILE *out = nullptr;
+        bool rowStarted = false;
+};
+
+constexpr int maxDatasets = 64;
+Dataset datasets[maxDatasets];
+
+// How far ahead of a read position dataprefetch asks the kernel to page in.
+constexpr size_t prefetchWindow = 2 << 20;
+
+Dataset *lookup(double handle) {
+    if (!(handle >= 0 && handle < maxDatasets))
+        return nullptr;
+    Dataset *d = &datasets[(int)handle];
+    return d->used ? d : nullptr;
+}
+
+const char *fileName(double slot, const char *fn) {
+    char var[32];
+    snprintf(var, sizeof(var), "KALEIDOSCOPE_FILE%ld", (long)slot);
+    const char *name = getenv(var);
+    if (!name)
+        fprintf(stderr, "%s: %s is not set\n", fn, var);
+    return name;
+}
+
+bool isText(const char *name) {
+    size_t len = strlen(name);
+    return (len > 4 && !strcmp(name + len - 4, ".csv")) ||
+           (len > 4 && !strcmp(name + len - 4, ".txt"));
+}
+
+int allocate() {
+    for (int i = 0; i != maxDatasets; i++)
+        if (!datasets[i].used) {
+            datasets[i] = Dataset();
+            datasets[i].used = true;
+            return i;
+        }
+    fprintf(stderr, "data: more than %d files open\n", maxDatasets);
+    return -1;
+}
+
+bool isSeparator(char c) {
+    return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Parses the number in [p, end) into value. Most numbers in data files have
+// few enough digits to be computed exactly from an integer mantissa and a
+// power of ten, which is correctly rounded; anything else goes to strtod.
+bool parseNumber(const char *p, const char *end, double &value) {
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                    1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                    1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = p;
+    bool negative = p != end && *p == '-';
+    if (p != end && (*p == '-' || *p == '+'))
+        p++;
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p != end && *p >= '0' && *p <= '9'; p++, any = true)
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else
+            exponent++;
+    if (p != end && *p == '.')
+        for (p++; p != end && *p >= '0' && *p <= '9'; p++, any = true)
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+    if (!any)
+        return false;
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        const char *e = p + 1;
+        bool negExp = e != end && *e == '-';
+        if (e != end && (*e == '-' || *e == '+'))
+            e++;
+        int exp = 0;
+        bool expDigits = false;
+        for (; e != end && *e >= '0' && *e <= '9'; e++, expDigits = true)
+            exp = exp < 10000 ? exp * 10 + (*e - '0') : exp;
+        if (!expDigits)
+            return false;
+        exponent += negExp ? -exp : exp;
+        p = e;
+    }
+    if (p != end && !isSeparator(*p))
+        return false;
+
+    if (mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double v = (double)mantissa;
+        v = exponent < 0 ? v / powers[-exponent] : v * powers[exponent];
+        value = negative ? -v : v;
+        return true;
+    }
+
+    char buf[128];
+    size_t len = p - start;
+    if (len >= sizeof(buf))
+        return false;
+    memcpy(buf, start, len);
+    buf[len] = 0;
+    value = strtod(buf, nullptr);
+    return true;
+}
+
+// Finds the next number at or after pos, skipping anything that isn't one.
+// Returns false at the end of the file.
+bool scanText(const Dataset &d, size_t &pos, double &value) {
+    const char *end = d.data + d.size;
+    while (true) {
+        while (pos != d.size && isSeparator(d.data[pos]))
+            pos++;
+        if (pos == d.size)
+            return false;
+        const char *token = d.data + pos;
+        const char *tokenEnd = token;
+        while (tokenEnd != end && !isSeparator(*tokenEnd))
+            tokenEnd++;
+        pos = tokenEnd - d.data;
+        if (parseNumber(token, tokenEnd, value))
+            return true;
+    }
+}
+
+bool peekText(Dataset &d) {
+    if (!d.peeked) {
+        d.peekEnd = d.pos;
+        d.peeked = scanText(d, d.peekEnd, d.peekValue);
+    }
+    return d.peeked;
+}
+
+bool nextText(Dataset &d, double &value) {
+    if (!peekText(d))
+        return false;
+    value = d.peekValue;
+    d.pos = d.peekEnd;
+    d.index++;
+    d.peeked = false;
+    return true;
+}
+
+double readBinary(const Dataset &d, size_t i) {
+    double value;
+    memcpy(&value, d.data + i * sizeof(double), sizeof(double));
+    return value;
+}
+
+} // namespace
+
+double dataopen(double slot) {
+    const char *name = fileName(slot, "dataopen");
+    if (!name)
+        return -1;
+
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(name);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    void *data = nullptr;
+    if (st.st_size) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(name);
+            close(fd);
+            return -1;
+        }
+    }
+    // The mapping keeps the file open.
+    close(fd);
+
+    int handle = allocate();
+    if (handle < 0) {
+        if (data)
+            munmap(data, st.st_size);
+        return -1;
+    }
+    Dataset &d = datasets[handle];
+    d.data = (const char *)data;
+    d.size = st.st_size;
+    d.text = isText(name);
+    d.count = d.text ? SIZE_MAX : d.size / sizeof(double);
+    // Text is only ever read front to back, so let the kernel read ahead
+    // aggressively and drop pages behind the cursor.
+    if (d.text && data)
+        madvise(data, d.size, MADV_SEQUENTIAL);
+    return handle;
+}
+
+double datacreate(double slot) {
+    const char *name = fileName(slot, "datacreate");
+    if (!name)
+        return -1;
+
+    FILE *out = fopen(name, "wb");
+    if (!out) {
+        perror(name);
+        return -1;
+    }
+    int handle = allocate();
+    if (handle < 0) {
+        fclose(out);
+        return -1;
+    }
+    setvbuf(out, nullptr, _IOFBF, 1 << 20);
+    datasets[handle].out = out;
+    datasets[handle].text = isText(name);
+    return handle;
+}
+
+double datalen(double handle) {
+    Dataset *d = lookup(handle);
+    if (!d || d->out)
+        return -1;
+    if (d->count == SIZE_MAX) {
+        size_t pos = 0, count = 0;
+        double value;
+        while (scanText(*d, pos, value))
+            count++;
+        d->count = count;
+    }
+    return (double)d->count;
+}
+
+double dataget(double handle, double index) {
+    Dataset *d = lookup(handle);
+    if (!d || d->out || !(index >= 0))
+        return NAN;
+    size_t i = (size_t)index;
+    if (!d->text)
+        return i < d->count ? readBinary(*d, i) : NAN;
+
+    if (i < d->index) {
+        d->pos = d->index = 0;
+        d->peeked = false;
+    }
+    double value;
+    while (nextText(*d, value))
+        if (d->index == i + 1)
+            return value;
+    return NAN;
+}
+
+double datanext(double handle) {
+    Dataset *d = lookup(handle);
+    if (!d || d->out)
+        return NAN;
+    if (!d->text)
+        return d->index < d->count ? readBinary(*d, d->index++) : NAN;
+    double value;
+    return nextText(*d, value) ? value : NAN;
+}
+
+double dataeof(double handle) {
+    Dataset *d = lookup(handle);
+    if (!d || d->out)
+        return 1;
+    return d->text ? !peekText(*d) : d->index >= d->count;
+}
+
+double dataprefetch(double handle, double index) {
+    Dataset *d = lookup(handle);
+    if (!d || d->out || !d->size || !(index >= 0))
+        return 0;
+
+    size_t offset = d->text ? d->pos : (size_t)index * sizeof(double);
+    if (offset >= d->size)
+        return 0;
+    __builtin_prefetch(d->data + offset);
+
+    // madvise wants a page-aligned start; the mapping itself is aligned.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+    size_t len = std::min(prefetchWindow, d->size - start);
+    madvise((void *)(d->data + start), len, MADV_WILLNEED);
+    return 0;
+}
+
+double datawrite(double handle, double value) {
+    Dataset *d = lookup(handle);
+    if (!d || !d->out)
+        return -1;
+    if (!d->text)
+        return fwrite(&value, sizeof(value), 1, d->out) == 1 ? 0 : -1;
+    int written = fprintf(d->out, d->rowStarted ? ",%.17g" : "%.17g", value);
+    d->rowStarted = true;
+    return written < 0 ? -1 : 0;
+}
+
+double datarow(double handle) {
+    Dataset *d = lookup(handle);
+    if (!d || !d->out)
+        return -1;
+    if (d->text) {
+        fputc('\n', d->out);
+        d->rowStarted = false;
+    }
+    return 0;
+}
+
+double dataclose(double handle) {
+    Dataset *d = lookup(handle);
+    if (!d)
+        return -1;
+
+    int err = 0;
+    if (d->out) {
+        if (d->text && d->rowStarted)
+            fputc('\n', d->out);
+        err = fclose(d->out);
+    } else if (d->data)
+        err = munmap((void *)d->data, d->size);
+    *d = Dataset();
+    return err ? -1 : 0;
+}
@@ -6,15 +6,19 @@
 #include "debug.h"
 #include "llvm.h"
 
+DebugLevel debugLevel = DebugLevel::None;
+bool debug = false;
+
 std::unique_ptr<llvm::DIBuilder> dbuilder;
 struct DebugInfo ksDbgInfo;
-std::vector<llvm::DIScope *> lexicalBlocks;
 
 SourceLocation curLoc;
 SourceLocation lexLoc = {1, 0};
 
-SourceLocation curLoc;
-SourceLocation lexLoc = {1, 0};
+void setDebugLevel(DebugLevel level) {
+    debugLevel = level;
+    debug = level != DebugLevel::None;
+}
 
 llvm::DIType *DebugInfo::getDoubleTy() {
     if (dblTy)
@@ -24,6 +28,18 @@ llvm::DIType *DebugInfo::getDoubleTy() {
     return dblTy;
 }
 
+llvm::DIType *DebugInfo::getIntTy() {
+    if (intTy)
+        return intTy;
+
+    intTy = dbuilder->createBasicType("int", 64, llvm::dwarf::DW_ATE_signed);
+    return intTy;
+}
+
+llvm::DIType *DebugInfo::getType(ValueType type) {
+    return type == ValueType::Int ? getIntTy() : getDoubleTy();
+}
+
 void DebugInfo::emitLocation(ExprAST *ast) {
     if (!ast)
         return Builder->SetCurrentDebugLocation(llvm::DebugLoc());
@@ -33,11 +49,22 @@ void DebugInfo::emitLocation(ExprAST *ast) {
         scope->getContext(), ast->getLine(), ast->getCol(), scope));
 }
 
-void debugSetup() {
+// Starts debug info for the current module. Called once per module, so the
+// REPL gets a compile unit for every module it hands to the JIT.
+void debugSetup(const char *fileName) {
+    Module->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                          llvm::DEBUG_METADATA_VERSION);
+    Module->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+
+    bool lineTablesOnly = debugLevel == DebugLevel::LineTablesOnly;
     dbuilder = std::make_unique<llvm::DIBuilder>(*Module);
     ksDbgInfo.cu = dbuilder->createCompileUnit(
-        llvm::dwarf::DW_LANG_C, dbuilder->createFile("kaleidoscope.ks", "."),
-        "kaleidoscope", false, "", 0);
+        llvm::dwarf::DW_LANG_C, dbuilder->createFile(fileName, "."),
+        "kaleidoscope", lineTablesOnly, "", 0, "",
+        lineTablesOnly ? llvm::DICompileUnit::LineTablesOnly
+                       : llvm::DICompileUnit::FullDebug);
+    ksDbgInfo.dblTy = ksDbgInfo.intTy = nullptr;
+    ksDbgInfo.lexicalBlocks.clear();
 }
 
 void debugFinalize() { dbuilder->finalize(); }
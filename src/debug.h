@@ -4,19 +4,33 @@
 
 #include "llvm/IR/DIBuilder.h"
 
-constexpr bool debug = true;
+// None emits no debug info and tracks no source locations. LineTablesOnly
+// emits just enough for profilers and debuggers to map addresses to lines,
+// and is optimized like None. Full also describes variables and skips the
+// module-level optimization pipeline.
+enum class DebugLevel { None, LineTablesOnly, Full };
+
+extern DebugLevel debugLevel;
+// Whether any debug info is emitted; kept in sync by setDebugLevel.
+extern bool debug;
+
+void setDebugLevel(DebugLevel level);
 
 extern std::unique_ptr<llvm::DIBuilder> dbuilder;
 
 class ExprAST;
+enum class ValueType;
 
 struct DebugInfo {
     public:
         llvm::DICompileUnit *cu;
         llvm::DIType *dblTy;
+        llvm::DIType *intTy;
         std::vector<llvm::DIScope *> lexicalBlocks;
 
         llvm::DIType *getDoubleTy();
+        llvm::DIType *getIntTy();
+        llvm::DIType *getType(ValueType type);
         void emitLocation(ExprAST *ast);
 };
 
@@ -31,5 +45,5 @@ struct SourceLocation {
 extern SourceLocation curLoc;
 extern SourceLocation lexLoc;
 
-void debugSetup();
+void debugSetup(const char *fileName);
 void debugFinalize();
@@ -0,0 +1,310 @@
+#include <cassert>
+#include <ctime>
+
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/Triple.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "jitListener.h"
+
+// Record layouts from tools/perf/util/jitdump.h in the Linux tree.
+namespace {
+    enum : uint32_t {
+        jitdumpMagic = 0x4A695444,
+        jitdumpVersion = 1,
+        jitCodeLoad = 0,
+        jitCodeDebugInfo = 2,
+    };
+
+    struct JitdumpHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t totalSize;
+            uint32_t elfMach;
+            uint32_t pad1;
+            uint32_t pid;
+            uint64_t timestamp;
+            uint64_t flags;
+    };
+
+    struct JitdumpRecord {
+            uint32_t id;
+            uint32_t totalSize;
+            uint64_t timestamp;
+    };
+
+    struct JitdumpCodeLoad {
+            JitdumpRecord prefix;
+            uint32_t pid;
+            uint32_t tid;
+            uint64_t vma;
+            uint64_t codeAddr;
+            uint64_t codeSize;
+            uint64_t codeIndex;
+    };
+
+    struct JitdumpDebugInfo {
+            JitdumpRecord prefix;
+            uint64_t codeAddr;
+            uint64_t numEntries;
+    };
+
+    struct JitdumpDebugEntry {
+            uint64_t addr;
+            int32_t line;
+            int32_t discrim;
+    };
+
+    // perf expects jitdump timestamps from the monotonic clock
+    // (`perf record -k mono`).
+    uint64_t monotonicNanos() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    uint32_t hostElfMachine() {
+        switch (llvm::Triple(llvm::sys::getProcessTriple()).getArch()) {
+            case llvm::Triple::x86_64:
+                return llvm::ELF::EM_X86_64;
+            case llvm::Triple::x86:
+                return llvm::ELF::EM_386;
+            case llvm::Triple::aarch64:
+                return llvm::ELF::EM_AARCH64;
+            case llvm::Triple::riscv64:
+                return llvm::ELF::EM_RISCV;
+            default:
+                return llvm::ELF::EM_NONE;
+        }
+    }
+} // namespace
+
+JITCodeListener::JITCodeListener(bool perfMap, bool jitdump) {
+    unsigned pid = llvm::sys::Process::getProcessId();
+    if (perfMap) {
+        perfMapPath = "/tmp/perf-" + std::to_string(pid) + ".map";
+        perfMapFile = fopen(perfMapPath.c_str(), "w");
+        if (!perfMapFile)
+            fprintf(stderr, "Error: could not open %s\n", perfMapPath.c_str());
+    }
+    if (jitdump)
+        openJitdump();
+}
+
+JITCodeListener::~JITCodeListener() {
+    if (perfMapFile)
+        fclose(perfMapFile);
+#ifdef __linux__
+    if (jitdumpMarker)
+        munmap(jitdumpMarker, sysconf(_SC_PAGESIZE));
+#endif
+    if (jitdumpFile)
+        fclose(jitdumpFile);
+}
+
+void JITCodeListener::openJitdump() {
+#ifdef __linux__
+    const char *dir = getenv("JITDUMPDIR");
+    std::string path = std::string(dir ? dir : ".") + "/jit-" +
+                       std::to_string(getpid()) + ".dump";
+    jitdumpFile = fopen(path.c_str(), "w+");
+    if (!jitdumpFile) {
+        fprintf(stderr, "Error: could not open %s\n", path.c_str());
+        return;
+    }
+
+    // perf finds the dump through this executable mapping of it.
+    jitdumpMarker =
+        mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+             MAP_PRIVATE, fileno(jitdumpFile), 0);
+    if (jitdumpMarker == MAP_FAILED)
+        jitdumpMarker = nullptr;
+
+    JitdumpHeader header = {};
+    header.magic = jitdumpMagic;
+    header.version = jitdumpVersion;
+    header.totalSize = sizeof(header);
+    header.elfMach = hostElfMachine();
+    header.pid = getpid();
+    header.timestamp = monotonicNanos();
+    fwrite(&header, sizeof(header), 1, jitdumpFile);
+    fflush(jitdumpFile);
+#endif
+}
+
+void JITCodeListener::notifyObjectLoaded(
+    ObjectKey key, const llvm::object::ObjectFile &obj,
+    const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+    // The debug object has its sections at their load addresses.
+    auto debugObj = info.getObjectForDebug(obj);
+    if (!debugObj.getBinary())
+        return;
+    const llvm::object::ObjectFile &dobj = *debugObj.getBinary();
+
+    std::unique_ptr<llvm::DWARFContext> dwarf;
+    if (dobj.hasDebugInfo())
+        dwarf = llvm::DWARFContext::create(dobj);
+    llvm::DILineInfoSpecifier spec(
+        llvm::DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath,
+        llvm::DILineInfoSpecifier::FunctionNameKind::None);
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto &addrs = objects[key];
+
+    for (const auto &[sym, size] : llvm::object::computeSymbolSizes(dobj)) {
+        auto type = sym.getType();
+        if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+            llvm::consumeError(type.takeError());
+            continue;
+        }
+        auto name = sym.getName();
+        auto addr = sym.getAddress();
+        auto section = sym.getSection();
+        if (!name || !addr || !section ||
+            *section == dobj.section_end() || !size) {
+            llvm::consumeError(name.takeError());
+            llvm::consumeError(addr.takeError());
+            llvm::consumeError(section.takeError());
+            continue;
+        }
+
+        FunctionEntry entry;
+        entry.addr = *addr;
+        entry.size = size;
+        entry.name = name->str();
+
+        if (dwarf) {
+            llvm::object::SectionedAddress start{*addr,
+                                                 (*section)->getIndex()};
+            for (auto &[lineAddr, line] :
+                 dwarf->getLineInfoForAddressRange(start, size, spec))
+                entry.lines.push_back({lineAddr, line.Line, line.FileName});
+        }
+
+        dropOverlapping(entry.addr, entry.size);
+        if (perfMapFile) {
+            fprintf(perfMapFile, "%llx %llx %s\n",
+                    (unsigned long long)entry.addr,
+                    (unsigned long long)entry.size, entry.name.c_str());
+            perfMapLines++;
+        }
+        if (jitdumpFile)
+            writeJitdump(entry);
+
+        addrs.push_back(entry.addr);
+        functions[entry.addr] = std::move(entry);
+    }
+
+    // perf takes the last line for an address, so stale lines are harmless
+    // but pile up when code is freed and reused. Compacting once they
+    // outnumber live ones keeps the cost linear in the lines written.
+    if (perfMapFile && perfMapLines > 2 * functions.size())
+        writePerfMap();
+    if (perfMapFile)
+        fflush(perfMapFile);
+}
+
+void JITCodeListener::notifyFreeingObject(ObjectKey key) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto obj = objects.find(key);
+    if (obj == objects.end())
+        return;
+
+    for (uint64_t addr : obj->second) {
+        auto f = functions.find(addr);
+        if (f != functions.end())
+            f->second.freed = true;
+    }
+    objects.erase(obj);
+}
+
+// Forgets freed functions overlapping [addr, addr + size), whose range is
+// about to hold new code.
+void JITCodeListener::dropOverlapping(uint64_t addr, uint64_t size) {
+    auto it = functions.upper_bound(addr);
+    if (it != functions.begin())
+        --it;
+    while (it != functions.end() && it->first < addr + size) {
+        if (it->first + it->second.size > addr) {
+            assert(it->second.freed && "live JIT functions overlap");
+            it = functions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void JITCodeListener::writePerfMap() {
+    std::string tmpPath = perfMapPath + ".tmp";
+    FILE *tmp = fopen(tmpPath.c_str(), "w");
+    if (!tmp)
+        return;
+    for (auto &[addr, entry] : functions)
+        fprintf(tmp, "%llx %llx %s\n", (unsigned long long)addr,
+                (unsigned long long)entry.size, entry.name.c_str());
+    fclose(tmp);
+
+    fclose(perfMapFile);
+    rename(tmpPath.c_str(), perfMapPath.c_str());
+    perfMapFile = fopen(perfMapPath.c_str(), "a");
+    perfMapLines = functions.size();
+}
+
+void JITCodeListener::writeJitdump(const FunctionEntry &entry) {
+    uint64_t timestamp = monotonicNanos();
+
+    // Line records must precede the code they describe.
+    if (!entry.lines.empty()) {
+        JitdumpDebugInfo debugInfo = {};
+        uint32_t size = sizeof(debugInfo);
+        for (auto &line : entry.lines)
+            size += sizeof(JitdumpDebugEntry) + line.file.size() + 1;
+
+        debugInfo.prefix = {jitCodeDebugInfo, size, timestamp};
+        debugInfo.codeAddr = entry.addr;
+        debugInfo.numEntries = entry.lines.size();
+        fwrite(&debugInfo, sizeof(debugInfo), 1, jitdumpFile);
+        for (auto &line : entry.lines) {
+            JitdumpDebugEntry debugEntry = {line.addr, (int32_t)line.line, 0};
+            fwrite(&debugEntry, sizeof(debugEntry), 1, jitdumpFile);
+            fwrite(line.file.c_str(), line.file.size() + 1, 1, jitdumpFile);
+        }
+    }
+
+    JitdumpCodeLoad load = {};
+    load.prefix = {jitCodeLoad,
+                   (uint32_t)(sizeof(load) + entry.name.size() + 1 +
+                              entry.size),
+                   timestamp};
+    load.pid = llvm::sys::Process::getProcessId();
+    load.tid = llvm::get_threadid();
+    load.vma = entry.addr;
+    load.codeAddr = entry.addr;
+    load.codeSize = entry.size;
+    load.codeIndex = codeIndex++;
+    fwrite(&load, sizeof(load), 1, jitdumpFile);
+    fwrite(entry.name.c_str(), entry.name.size() + 1, 1, jitdumpFile);
+    fwrite((const void *)entry.addr, entry.size, 1, jitdumpFile);
+    fflush(jitdumpFile);
+}
+
+bool JITCodeListener::lookup(uint64_t pc, FunctionEntry &out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = functions.upper_bound(pc);
+    if (it == functions.begin())
+        return false;
+    --it;
+    if (pc >= it->first + it->second.size)
+        return false;
+    out = it->second;
+    return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+// Tracks every function the JIT materializes, with its source lines when the
+// object carries debug info, and optionally publishes them for perf:
+//
+//  - perf map: /tmp/perf-<pid>.map, one "start size name" line per function.
+//  - jitdump: jit-<pid>.dump (in $JITDUMPDIR or the working directory), with
+//    code load and line records for `perf inject --jit`.
+//
+// The perf map format has no notion of unloading, so code freed by a resource
+// tracker stays listed until the slab allocator hands its range to something
+// else; only then is the stale entry dropped and the map rewritten. jitdump
+// records are timestamped, which lets perf resolve reused ranges itself.
+class JITCodeListener : public llvm::JITEventListener {
+    public:
+        struct LineEntry {
+                uint64_t addr;
+                unsigned line;
+                std::string file;
+        };
+
+        struct FunctionEntry {
+                uint64_t addr;
+                uint64_t size;
+                std::string name;
+                std::vector<LineEntry> lines;
+                bool freed = false;
+        };
+
+        JITCodeListener(bool perfMap, bool jitdump);
+        ~JITCodeListener() override;
+
+        void notifyObjectLoaded(
+            ObjectKey key, const llvm::object::ObjectFile &obj,
+            const llvm::RuntimeDyld::LoadedObjectInfo &info) override;
+        void notifyFreeingObject(ObjectKey key) override;
+
+        // Looks up the function containing pc, including freed functions
+        // whose range hasn't been reused. Returns false if pc isn't JIT code.
+        bool lookup(uint64_t pc, FunctionEntry &out) const;
+
+    private:
+        void dropOverlapping(uint64_t addr, uint64_t size);
+        void writePerfMap();
+        void openJitdump();
+        void writeJitdump(const FunctionEntry &entry);
+
+        mutable std::mutex lock;
+        std::map<uint64_t, FunctionEntry> functions;
+        std::map<ObjectKey, std::vector<uint64_t>> objects;
+
+        std::string perfMapPath;
+        FILE *perfMapFile = nullptr;
+        // Lines in the perf map, counting ones for dropped functions.
+        size_t perfMapLines = 0;
+
+        FILE *jitdumpFile = nullptr;
+        void *jitdumpMarker = nullptr;
+        uint64_t codeIndex = 0;
+};
@@ -0,0 +1,315 @@
+#include <cassert>
+#include <iterator>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Memory.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "jitMemoryManager.h"
+
+#ifdef __linux__
+
+std::unique_ptr<SlabPool> SlabPool::create(bool hugePages) {
+    // Reserve the whole arena up front (plus slack to align it to a huge
+    // page) so every slab lands within rel32 range of every other one.
+    size_t span = arenaSize + slabSize;
+    void *base = mmap(nullptr, span, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return nullptr;
+
+    uintptr_t start = (uintptr_t)base;
+    uintptr_t aligned = (start + slabSize - 1) & ~(uintptr_t)(slabSize - 1);
+    if (aligned != start)
+        munmap(base, aligned - start);
+    uintptr_t end = aligned + arenaSize;
+    if (end != start + span)
+        munmap((void *)end, start + span - end);
+
+    // Probe for memfd support now rather than on the first code allocation.
+    int fd = memfd_create("kaleidoscope-jit", MFD_CLOEXEC);
+    if (fd < 0) {
+        munmap((void *)aligned, arenaSize);
+        return nullptr;
+    }
+    close(fd);
+
+    return std::unique_ptr<SlabPool>(
+        new SlabPool((uint8_t *)aligned, hugePages));
+}
+
+SlabPool::~SlabPool() { munmap(arena, arenaSize); }
+
+uint8_t *SlabPool::reserveArena(size_t size) {
+    if (arenaUsed + size > arenaSize)
+        return nullptr;
+    uint8_t *addr = arena + arenaUsed;
+    arenaUsed += size;
+    return addr;
+}
+
+bool SlabPool::addSlab(Kind kind, size_t size) {
+    size = (size + slabSize - 1) & ~(slabSize - 1);
+
+    Slab slab;
+    slab.size = size;
+    slab.addr = reserveArena(size);
+    if (!slab.addr)
+        return false;
+
+    bool huge = false;
+    if (kind == Kind::Data) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+        void *p = MAP_FAILED;
+        if (hugePages)
+            p = mmap(slab.addr, size, PROT_READ | PROT_WRITE,
+                     flags | MAP_HUGETLB, -1, 0);
+        huge = p != MAP_FAILED;
+        if (!huge)
+            p = mmap(slab.addr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            arenaUsed -= size;
+            return false;
+        }
+        slab.execAddr = slab.addr;
+    } else {
+        slab.execAddr = reserveArena(size);
+        if (!slab.execAddr) {
+            arenaUsed -= size;
+            return false;
+        }
+
+        int fd = -1;
+        if (hugePages) {
+            fd = memfd_create("kaleidoscope-jit", MFD_CLOEXEC | MFD_HUGETLB);
+            if (fd >= 0 && ftruncate(fd, size)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        huge = fd >= 0;
+        if (!huge) {
+            fd = memfd_create("kaleidoscope-jit", MFD_CLOEXEC);
+            if (fd < 0 || ftruncate(fd, size)) {
+                if (fd >= 0)
+                    close(fd);
+                arenaUsed -= 2 * size;
+                return false;
+            }
+        }
+
+        void *rw = mmap(slab.addr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, fd, 0);
+        void *rx = rw == MAP_FAILED
+                       ? MAP_FAILED
+                       : mmap(slab.execAddr, size, PROT_READ | PROT_EXEC,
+                              MAP_SHARED | MAP_FIXED, fd, 0);
+        close(fd);
+        // hugetlbfs reserves its pages at mmap time; if the reservation
+        // failed, retry the slab with ordinary pages.
+        if (rw == MAP_FAILED || rx == MAP_FAILED) {
+            arenaUsed -= 2 * size;
+            if (huge) {
+                bool saved = hugePages;
+                hugePages = false;
+                bool ok = addSlab(kind, size);
+                hugePages = saved;
+                return ok;
+            }
+            return false;
+        }
+    }
+
+    // Without reserved hugetlb pages, transparent huge pages are the next
+    // best thing.
+    if (!huge) {
+        madvise(slab.addr, size, MADV_HUGEPAGE);
+        if (slab.execAddr != slab.addr)
+            madvise(slab.execAddr, size, MADV_HUGEPAGE);
+    } else
+        hugeSlabs++;
+
+    slabs.push_back(slab);
+    bytesReserved += size;
+    insertFree(kind, slab.addr, size, slabs.size() - 1);
+    return true;
+}
+
+#else
+
+std::unique_ptr<SlabPool> SlabPool::create(bool hugePages) { return nullptr; }
+
+SlabPool::~SlabPool() {}
+
+uint8_t *SlabPool::reserveArena(size_t size) { return nullptr; }
+
+bool SlabPool::addSlab(Kind kind, size_t size) { return false; }
+
+#endif
+
+SlabPool::SlabPool(uint8_t *arena, bool hugePages)
+    : arena(arena), hugePages(hugePages) {}
+
+// Adds a free range, coalescing it with its neighbours in the same slab.
+void SlabPool::insertFree(Kind kind, uint8_t *addr, size_t size,
+                          unsigned slab) {
+    auto &ranges = freeRanges[(int)kind];
+
+    auto next = ranges.lower_bound(addr);
+    if (next != ranges.end() && next->second.slab == slab &&
+        addr + size == next->first) {
+        size += next->second.size;
+        next = ranges.erase(next);
+    }
+
+    if (next != ranges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->second.slab == slab &&
+            prev->first + prev->second.size == addr) {
+            prev->second.size += size;
+            return;
+        }
+    }
+
+    ranges.emplace_hint(next, addr, FreeRange{size, slab});
+}
+
+// First fit over the free ranges, falling back to a new slab.
+bool SlabPool::allocate(Kind kind, size_t size, unsigned alignment,
+                        Block &out) {
+    if (!size)
+        size = 1;
+    if (!alignment)
+        alignment = 16;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto &ranges = freeRanges[(int)kind];
+
+    for (int attempt = 0; attempt != 2; attempt++) {
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            uintptr_t start = (uintptr_t)it->first;
+            uintptr_t aligned =
+                (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+            size_t padding = aligned - start;
+            if (padding + size > it->second.size)
+                continue;
+
+            uint8_t *rangeAddr = it->first;
+            FreeRange range = it->second;
+            ranges.erase(it);
+
+            if (padding)
+                insertFree(kind, rangeAddr, padding, range.slab);
+            size_t tail = range.size - padding - size;
+            if (tail)
+                insertFree(kind, (uint8_t *)aligned + size, tail, range.slab);
+
+            const Slab &slab = slabs[range.slab];
+            out.kind = kind;
+            out.addr = (uint8_t *)aligned;
+            out.execAddr = slab.execAddr + (out.addr - slab.addr);
+            out.size = size;
+            out.slab = range.slab;
+            bytesUsed += size;
+            return true;
+        }
+
+        if (attempt == 0 && !addSlab(kind, size + alignment))
+            return false;
+    }
+    return false;
+}
+
+void SlabPool::release(const Block &block) {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(block.slab < slabs.size() && "block not owned by this pool");
+
+    bytesUsed -= block.size;
+    insertFree(block.kind, block.addr, block.size, block.slab);
+}
+
+size_t SlabPool::getBytesReserved() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return bytesReserved;
+}
+
+size_t SlabPool::getBytesUsed() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return bytesUsed;
+}
+
+bool SlabPool::usingHugePages() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return hugeSlabs != 0;
+}
+
+void SlabPool::printStats(llvm::raw_ostream &out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    out << "JIT memory: " << bytesUsed << " bytes used of " << bytesReserved
+        << " reserved in " << slabs.size() << " slabs (" << hugeSlabs
+        << " on hugetlb pages)";
+    if (bytesReserved)
+        out << llvm::format(", %.1f%% utilization",
+                            100.0 * bytesUsed / bytesReserved);
+    out << '\n';
+}
+
+SlabMemoryManager::SlabMemoryManager(SlabPool &pool) : pool(pool) {}
+
+SlabMemoryManager::~SlabMemoryManager() {
+    for (auto &block : blocks)
+        pool.release(block);
+}
+
+uint8_t *SlabMemoryManager::allocate(SlabPool::Kind kind, uintptr_t size,
+                                     unsigned alignment) {
+    SlabPool::Block block;
+    if (!pool.allocate(kind, size, alignment, block))
+        return nullptr;
+    blocks.push_back(block);
+    return block.addr;
+}
+
+uint8_t *SlabMemoryManager::allocateCodeSection(uintptr_t size,
+                                                unsigned alignment,
+                                                unsigned sectionID,
+                                                llvm::StringRef sectionName) {
+    return allocate(SlabPool::Kind::Code, size, alignment);
+}
+
+uint8_t *SlabMemoryManager::allocateDataSection(uintptr_t size,
+                                                unsigned alignment,
+                                                unsigned sectionID,
+                                                llvm::StringRef sectionName,
+                                                bool isReadOnly) {
+    return allocate(SlabPool::Kind::Data, size, alignment);
+}
+
+// Code is written through the writable view, so tell RuntimeDyld to resolve
+// symbols and relocations against the executable view instead.
+void SlabMemoryManager::notifyObjectLoaded(
+    llvm::RuntimeDyld &dyld, const llvm::object::ObjectFile &obj) {
+    for (auto &block : blocks)
+        if (block.addr != block.execAddr)
+            dyld.mapSectionAddress(block.addr, (uint64_t)block.execAddr);
+}
+
+bool SlabMemoryManager::finalizeMemory(std::string *errMsg) {
+    for (auto &block : blocks)
+        if (block.kind == SlabPool::Kind::Code)
+            llvm::sys::Memory::InvalidateInstructionCache(block.execAddr,
+                                                          block.size);
+    return false;
+}
+
+size_t SlabMemoryManager::getBytesAllocated() const {
+    size_t total = 0;
+    for (auto &block : blocks)
+        total += block.size;
+    return total;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Backing store shared by every object the JIT links. Small objects are
+// packed into 2MB slabs carved out of one reserved address range, so code
+// stays dense (and within rel32 range of its data) instead of costing each
+// REPL definition a few fresh pages.
+//
+// Code slabs are mapped twice from the same memfd: a writable view that
+// RuntimeDyld copies and relocates into, and an executable view the code
+// runs from. That lets objects share code pages without ever making a page
+// both writable and executable. Data slabs (read-only data included) are
+// plain read-write memory.
+class SlabPool {
+    public:
+        enum class Kind { Code, Data };
+
+        struct Block {
+                Kind kind;
+                uint8_t *addr;     // where the contents are written
+                uint8_t *execAddr; // where the contents run from
+                size_t size;
+                unsigned slab;
+        };
+
+        // Returns null if slabs aren't supported on this host, in which case
+        // the JIT keeps using one SectionMemoryManager per object.
+        static std::unique_ptr<SlabPool> create(bool hugePages);
+        ~SlabPool();
+
+        bool allocate(Kind kind, size_t size, unsigned alignment, Block &out);
+        void release(const Block &block);
+
+        size_t getBytesReserved() const;
+        size_t getBytesUsed() const;
+        bool usingHugePages() const;
+        void printStats(llvm::raw_ostream &out) const;
+
+        static constexpr size_t slabSize = 2 * 1024 * 1024;
+        static constexpr size_t arenaSize = size_t(1) << 30;
+
+    private:
+        struct Slab {
+                uint8_t *addr;
+                uint8_t *execAddr;
+                size_t size;
+        };
+
+        struct FreeRange {
+                size_t size;
+                unsigned slab;
+        };
+
+        SlabPool(uint8_t *arena, bool hugePages);
+        bool addSlab(Kind kind, size_t size);
+        uint8_t *reserveArena(size_t size);
+        void insertFree(Kind kind, uint8_t *addr, size_t size, unsigned slab);
+
+        mutable std::mutex lock;
+        uint8_t *arena;
+        size_t arenaUsed = 0;
+        bool hugePages;
+        unsigned hugeSlabs = 0;
+
+        std::vector<Slab> slabs;
+        std::map<uint8_t *, FreeRange> freeRanges[2];
+        size_t bytesReserved = 0;
+        size_t bytesUsed = 0;
+};
+
+// Per-object memory manager handing out blocks from a SlabPool. The
+// RTDyldObjectLinkingLayer destroys it when the object's resource tracker is
+// removed, which returns its blocks to the pool for reuse.
+class SlabMemoryManager : public llvm::RTDyldMemoryManager {
+    public:
+        SlabMemoryManager(SlabPool &pool);
+        ~SlabMemoryManager() override;
+
+        uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment,
+                                     unsigned sectionID,
+                                     llvm::StringRef sectionName) override;
+        uint8_t *allocateDataSection(uintptr_t size, unsigned alignment,
+                                     unsigned sectionID,
+                                     llvm::StringRef sectionName,
+                                     bool isReadOnly) override;
+        using llvm::RTDyldMemoryManager::notifyObjectLoaded;
+        void notifyObjectLoaded(llvm::RuntimeDyld &dyld,
+                                const llvm::object::ObjectFile &obj) override;
+        bool finalizeMemory(std::string *errMsg = nullptr) override;
+
+        size_t getBytesAllocated() const;
+
+    private:
+        uint8_t *allocate(SlabPool::Kind kind, uintptr_t size,
+                          unsigned alignment);
+
+        SlabPool &pool;
+        std::vector<SlabPool::Block> blocks;
+};
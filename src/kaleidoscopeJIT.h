@@ -13,53 +13,300 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "jitMemoryManager.h"
 
 namespace llvm {
     namespace orc {
 
+        // Keeps a copy of the object compiled for each module it was told to
+        // expect, so evicted functions can be relinked without recompiling.
+        class ObjectKeeper : public ObjectCache {
+            private:
+                std::mutex Lock;
+                StringMap<std::unique_ptr<MemoryBuffer>> Objects;
+
+            public:
+                void expect(StringRef ModuleID) {
+                    std::lock_guard<std::mutex> Guard(Lock);
+                    Objects[ModuleID] = nullptr;
+                }
+
+                void forget(StringRef ModuleID) {
+                    std::lock_guard<std::mutex> Guard(Lock);
+                    Objects.erase(ModuleID);
+                }
+
+                std::unique_ptr<MemoryBuffer> copy(StringRef ModuleID) {
+                    std::lock_guard<std::mutex> Guard(Lock);
+                    auto I = Objects.find(ModuleID);
+                    if (I == Objects.end() || !I->second)
+                        return nullptr;
+                    return MemoryBuffer::getMemBufferCopy(
+                        I->second->getBuffer(),
+                        I->second->getBufferIdentifier());
+                }
+
+                void notifyObjectCompiled(const Module *M,
+                                          MemoryBufferRef Obj) override {
+                    std::lock_guard<std::mutex> Guard(Lock);
+                    auto I = Objects.find(M->getModuleIdentifier());
+                    if (I != Objects.end())
+                        I->second = MemoryBuffer::getMemBufferCopy(
+                            Obj.getBuffer(), Obj.getBufferIdentifier());
+                }
+
+                std::unique_ptr<MemoryBuffer>
+                getObject(const Module *M) override {
+                    return nullptr;
+                }
+        };
+
         class KaleidoscopeJIT {
             private:
                 std::unique_ptr<ExecutionSession> ES;
+                std::unique_ptr<SlabPool> Slabs;
 
                 DataLayout DL;
                 MangleAndInterner Mangle;
 
+                ObjectKeeper KeptObjects;
                 RTDyldObjectLinkingLayer ObjectLayer;
                 IRCompileLayer CompileLayer;
+                IRTransformLayer OptimizeLayer;
 
                 JITDylib &MainJD;
 
+                // Where one version of a function compiled by
+                // defineFunctionAsync has got to. Written by whichever JIT
+                // thread finishes the compile.
+                struct PendingCompile {
+                        std::mutex Lock;
+                        std::condition_variable Finished;
+                        bool Done = false;
+                        bool Failed = false;
+                        // Set once a newer version has replaced this one,
+                        // which may then no longer repoint the stub.
+                        bool Superseded = false;
+                };
+
+                // Every function defined through defineFunction is called via
+                // an indirection stub, so it can be redefined without
+                // recompiling its callers.
+                struct FunctionDef {
+                        ResourceTrackerSP RT;
+                        unsigned Version = 0;
+                        std::string ImplName;
+                        bool Resident = true;
+                        // Epoch of the most recent call, written by the
+                        // function's own entry block.
+                        uint64_t *LastUsed = nullptr;
+                        // Null unless defined by defineFunctionAsync.
+                        std::shared_ptr<PendingCompile> Pending;
+                        // The functions defined here that this version calls.
+                        std::vector<std::string> Callees;
+                };
+                std::unique_ptr<IndirectStubsManager> Stubs;
+                StringMap<FunctionDef> Functions;
+
+                // With a memory budget, cold functions are evicted: their code
+                // is freed and their stub is pointed at a call-through
+                // trampoline that relinks the kept object on the next call.
+                size_t MemoryBudget = 0;
+                uint64_t Epoch = 0;
+                std::deque<uint64_t> UseSlots;
+                std::unique_ptr<LazyCallThroughManager> CallThrough;
+                uint64_t Evictions = 0;
+                uint64_t Rematerializations = 0;
+
+                // Definitions that failed to compile on a JIT thread, with
+                // the reason, until takeCompileFailures.
+                std::mutex FailuresLock;
+                std::vector<std::pair<std::string, std::string>> Failures;
+
+                static void handleCallThroughError() {
+                    errs() << "Error: failed to rematerialize an evicted "
+                              "function\n";
+                    abort();
+                }
+
+                // Where an asynchronously defined function's stub points
+                // until its body is compiled.
+                static void handleUncompiledCall() {
+                    errs() << "Error: called a function before it was "
+                              "compiled\n";
+                    abort();
+                }
+
+                static bool isCompiling(FunctionDef &Def) {
+                    if (!Def.Pending)
+                        return false;
+                    std::lock_guard<std::mutex> Guard(Def.Pending->Lock);
+                    return !Def.Pending->Done;
+                }
+
+                // The functions defined here that M calls. A user operator
+                // reaches M as an available_externally copy, and a call to
+                // it that isn't inlined, such as a recursive one, still
+                // goes to its stub.
+                std::vector<std::string> calledFunctions(Module &M) const {
+                    std::vector<std::string> Callees;
+                    for (auto &F : M)
+                        if ((F.isDeclaration() ||
+                             F.hasAvailableExternallyLinkage()) &&
+                            Functions.count(F.getName()))
+                            Callees.push_back(F.getName().str());
+                    return Callees;
+                }
+
+                // Renames the body of Name in TSM to its next version and
+                // notes what it calls. Returns the versioned name.
+                std::string prepareDefinition(StringRef Name, FunctionDef &Def,
+                                              ThreadSafeModule &TSM) {
+                    std::string ImplName =
+                        (Name + "." + Twine(++Def.Version)).str();
+                    if (!Def.LastUsed)
+                        Def.LastUsed = &UseSlots.emplace_back();
+                    *Def.LastUsed = Epoch;
+                    TSM.withModuleDo([&](Module &M) {
+                        Function *F = M.getFunction(Name);
+                        F->setName(ImplName);
+                        M.setModuleIdentifier(ImplName);
+                        if (MemoryBudget)
+                            instrumentEntry(*F, Def.LastUsed);
+                        Def.Callees = calledFunctions(M);
+                    });
+                    if (MemoryBudget)
+                        KeptObjects.expect(ImplName);
+                    return ImplName;
+                }
+
+                Error addStub(const SymbolStringPtr &StubName,
+                              ExecutorAddr Addr) {
+                    auto Flags =
+                        JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+                    if (auto Err = Stubs->createStub(*StubName, Addr, Flags))
+                        return Err;
+                    auto Stub = Stubs->findStub(*StubName, false);
+                    return MainJD.define(absoluteSymbols({{StubName, Stub}}));
+                }
+
+                // Stores the current epoch into Slot on every entry to F.
+                void instrumentEntry(Function &F, uint64_t *Slot) {
+                    IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+                    auto *EpochAddr = B.CreateIntToPtr(
+                        B.getInt64((uint64_t)&Epoch), B.getPtrTy());
+                    auto *SlotAddr = B.CreateIntToPtr(
+                        B.getInt64((uint64_t)Slot), B.getPtrTy());
+                    B.CreateStore(B.CreateLoad(B.getInt64Ty(), EpochAddr),
+                                  SlotAddr);
+                }
+
+                Error evict(StringRef Name, FunctionDef &Def) {
+                    // The stub is repointed when the compile finishes.
+                    if (isCompiling(Def))
+                        return Error::success();
+
+                    auto Obj = KeptObjects.copy(Def.ImplName);
+                    if (!Obj)
+                        return Error::success();
+
+                    if (auto Err = Def.RT->remove())
+                        return Err;
+
+                    // Re-adding the object is lazy: nothing is linked (or
+                    // allocated) until the trampoline looks the body up.
+                    auto RT = MainJD.createResourceTracker();
+                    if (auto Err = ObjectLayer.add(RT, std::move(Obj)))
+                        return Err;
+
+                    // A trampoline's notifier only runs on its first call,
+                    // so each eviction needs a new one to repoint the stub
+                    // again. The manager can't release old trampolines; each
+                    // costs one slot in its pool.
+                    std::string StubName = (*Mangle(Name.str())).str();
+                    auto Trampoline = CallThrough->getCallThroughTrampoline(
+                        MainJD, Mangle(Def.ImplName),
+                        [this, StubName,
+                         Key = Name.str()](ExecutorAddr Resolved) -> Error {
+                            Functions[Key].Resident = true;
+                            Rematerializations++;
+                            return Stubs->updatePointer(StubName, Resolved);
+                        });
+                    if (!Trampoline)
+                        return Trampoline.takeError();
+                    if (auto Err = Stubs->updatePointer(StubName, *Trampoline))
+                        return Err;
+
+                    Def.RT = std::move(RT);
+                    Def.Resident = false;
+                    Evictions++;
+                    return Error::success();
+                }
+
             public:
                 KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                                JITTargetMachineBuilder JTMB, DataLayout DL)
-                    : ES(std::move(ES)), DL(std::move(DL)),
-                      Mangle(*this->ES, this->DL),
+                                JITTargetMachineBuilder JTMB, DataLayout DL,
+                                std::unique_ptr<SlabPool> Slabs)
+                    : ES(std::move(ES)), Slabs(std::move(Slabs)),
+                      DL(std::move(DL)), Mangle(*this->ES, this->DL),
                       ObjectLayer(
                           *this->ES,
-                          []() {
+                          [this]()
+                              -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                              if (this->Slabs)
+                                  return std::make_unique<SlabMemoryManager>(
+                                      *this->Slabs);
                               return std::make_unique<SectionMemoryManager>();
                           }),
                       CompileLayer(*this->ES, ObjectLayer,
                                    std::make_unique<ConcurrentIRCompiler>(
-                                       std::move(JTMB))),
-                      MainJD(this->ES->createBareJITDylib("<main>")) {
+                                       std::move(JTMB), &KeptObjects)),
+                      OptimizeLayer(*this->ES, CompileLayer),
+                      MainJD(this->ES->createBareJITDylib("<main>")),
+                      Stubs(createLocalIndirectStubsManagerBuilder(
+                          this->ES->getExecutorProcessControl()
+                              .getTargetTriple())()) {
                     MainJD.addGenerator(cantFail(
                         DynamicLibrarySearchGenerator::GetForCurrentProcess(
                             DL.getGlobalPrefix())));
+                    // Vectorized math builtins call libmvec, which the
+                    // process itself may not have loaded.
+                    if (auto VecLib = DynamicLibrarySearchGenerator::Load(
+                            "libmvec.so.1", DL.getGlobalPrefix()))
+                        MainJD.addGenerator(std::move(*VecLib));
+                    else
+                        consumeError(VecLib.takeError());
                     if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
                         ObjectLayer
                             .setOverrideObjectFlagsWithResponsibilityFlags(
@@ -74,8 +321,19 @@ namespace llvm {
                         ES->reportError(std::move(Err));
                 }
 
-                static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-                    auto EPC = SelfExecutorProcessControl::Create();
+                // FuseFPOps allows FMA contraction everywhere, not just in
+                // instructions carrying the contract flag. Concurrent
+                // compiles and links modules on a pool of threads rather
+                // than on whichever thread looks their symbols up.
+                static Expected<std::unique_ptr<KaleidoscopeJIT>>
+                Create(std::unique_ptr<SlabPool> Slabs = nullptr,
+                       bool FuseFPOps = false, bool Concurrent = false) {
+                    std::unique_ptr<TaskDispatcher> Dispatcher;
+                    if (Concurrent)
+                        Dispatcher =
+                            std::make_unique<DynamicThreadPoolTaskDispatcher>();
+                    auto EPC = SelfExecutorProcessControl::Create(
+                        nullptr, std::move(Dispatcher));
                     if (!EPC)
                         return EPC.takeError();
 
@@ -84,29 +342,275 @@ namespace llvm {
 
                     JITTargetMachineBuilder JTMB(
                         ES->getExecutorProcessControl().getTargetTriple());
+                    if (FuseFPOps)
+                        JTMB.getOptions().AllowFPOpFusion = FPOpFusion::Fast;
 
                     auto DL = JTMB.getDefaultDataLayoutForTarget();
                     if (!DL)
                         return DL.takeError();
 
                     return std::make_unique<KaleidoscopeJIT>(
-                        std::move(ES), std::move(JTMB), std::move(*DL));
+                        std::move(ES), std::move(JTMB), std::move(*DL),
+                        std::move(Slabs));
                 }
 
                 const DataLayout &getDataLayout() const { return DL; }
 
                 JITDylib &getMainJITDylib() { return MainJD; }
 
+                // Listeners are told about every object linked from here on.
+                void registerListener(JITEventListener &L) {
+                    ObjectLayer.registerJITEventListener(L);
+                }
+
+                // Null when objects get their own SectionMemoryManager.
+                const SlabPool *getSlabPool() const { return Slabs.get(); }
+
+                // Runs Transform over every module before it is compiled, on
+                // the thread compiling it.
+                void
+                setOptimizer(IRTransformLayer::TransformFunction Transform) {
+                    OptimizeLayer.setTransform(std::move(Transform));
+                }
+
                 Error addModule(ThreadSafeModule TSM,
                                 ResourceTrackerSP RT = nullptr) {
                     if (!RT)
                         RT = MainJD.getDefaultResourceTracker();
-                    return CompileLayer.add(RT, std::move(TSM));
+                    return OptimizeLayer.add(RT, std::move(TSM));
                 }
 
                 Expected<ExecutorSymbolDef> lookup(StringRef Name) {
                     return ES->lookup({&MainJD}, Mangle(Name.str()));
                 }
+
+                bool hasFunction(StringRef Name) const {
+                    return Functions.count(Name);
+                }
+
+                // Adds TSM, which defines the function Name, and points Name's
+                // stub at it. The body is renamed to a versioned symbol so old
+                // and new versions can coexist until the stub is repointed,
+                // after which the old version's code is freed. Callers must
+                // ensure no frame of the old version is live, which holds for
+                // the REPL: definitions are only added between top-level
+                // expressions.
+                Error defineFunction(StringRef Name, ThreadSafeModule TSM) {
+                    auto &Def = Functions[Name];
+                    std::string ImplName = prepareDefinition(Name, Def, TSM);
+
+                    auto RT = MainJD.createResourceTracker();
+                    if (auto Err = OptimizeLayer.add(RT, std::move(TSM)))
+                        return Err;
+
+                    auto Impl = lookup(ImplName);
+                    if (!Impl)
+                        return Impl.takeError();
+
+                    SymbolStringPtr StubName = Mangle(Name.str());
+                    if (Def.RT) {
+                        if (auto Err = Stubs->updatePointer(
+                                *StubName, Impl->getAddress()))
+                            return Err;
+                        if (auto Err = Def.RT->remove())
+                            return Err;
+                        KeptObjects.forget(Def.ImplName);
+                        ES->getSymbolStringPool()->clearDeadEntries();
+                    } else if (auto Err =
+                                   addStub(StubName, Impl->getAddress()))
+                        return Err;
+
+                    Def.RT = std::move(RT);
+                    Def.ImplName = std::move(ImplName);
+                    Def.Resident = true;
+                    return enforceMemoryBudget();
+                }
+
+                // Like defineFunction, but returns as soon as TSM is queued:
+                // it is compiled on the JIT's threads, and Name's stub is
+                // pointed at it once it is ready. Until then calling Name
+                // aborts, so run code only after waitForCallees says it may.
+                // A failed compile is kept for takeCompileFailures.
+                Error defineFunctionAsync(StringRef Name,
+                                          ThreadSafeModule TSM) {
+                    auto &Def = Functions[Name];
+                    std::string ImplName = prepareDefinition(Name, Def, TSM);
+
+                    auto RT = MainJD.createResourceTracker();
+                    if (auto Err = OptimizeLayer.add(RT, std::move(TSM)))
+                        return Err;
+
+                    SymbolStringPtr StubName = Mangle(Name.str());
+                    auto Uncompiled =
+                        ExecutorAddr::fromPtr(&handleUncompiledCall);
+                    if (Def.RT) {
+                        // The old version may still be compiling; once it is
+                        // superseded it leaves the stub alone.
+                        if (Def.Pending) {
+                            std::lock_guard<std::mutex> Guard(
+                                Def.Pending->Lock);
+                            Def.Pending->Superseded = true;
+                        }
+                        if (auto Err =
+                                Stubs->updatePointer(*StubName, Uncompiled))
+                            return Err;
+                        if (auto Err = Def.RT->remove())
+                            return Err;
+                        KeptObjects.forget(Def.ImplName);
+                        ES->getSymbolStringPool()->clearDeadEntries();
+                    } else if (auto Err = addStub(StubName, Uncompiled))
+                        return Err;
+
+                    // Looking the body up is what starts its compile.
+                    auto Pending = std::make_shared<PendingCompile>();
+                    ES->lookup(
+                        LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+                        SymbolLookupSet(Mangle(ImplName)), SymbolState::Ready,
+                        [this, Pending, Key = Name.str(),
+                         Stub = (*StubName).str()](Expected<SymbolMap> Result) {
+                            std::lock_guard<std::mutex> Guard(Pending->Lock);
+                            auto Resolve = [&]() -> Error {
+                                if (!Result)
+                                    return Result.takeError();
+                                if (Pending->Superseded)
+                                    return Error::success();
+                                return Stubs->updatePointer(
+                                    Stub, Result->begin()->second.getAddress());
+                            };
+                            if (auto Err = Resolve()) {
+                                if (Pending->Superseded)
+                                    consumeError(std::move(Err));
+                                else {
+                                    Pending->Failed = true;
+                                    std::lock_guard<std::mutex> FailuresGuard(
+                                        FailuresLock);
+                                    Failures.emplace_back(
+                                        Key, toString(std::move(Err)));
+                                }
+                            }
+                            Pending->Done = true;
+                            Pending->Finished.notify_all();
+                        },
+                        NoDependenciesToRegister);
+
+                    Def.RT = std::move(RT);
+                    Def.ImplName = std::move(ImplName);
+                    Def.Resident = true;
+                    Def.Pending = std::move(Pending);
+                    return enforceMemoryBudget();
+                }
+
+                // Blocks until every function TSM calls, directly or through
+                // the functions it calls, has finished compiling. Fails,
+                // naming the function, if one of them could not be compiled.
+                Error waitForCallees(ThreadSafeModule &TSM) {
+                    std::vector<std::string> Work;
+                    TSM.withModuleDo(
+                        [&](Module &M) { Work = calledFunctions(M); });
+                    StringSet<> Seen;
+                    for (auto &Name : Work)
+                        Seen.insert(Name);
+
+                    while (!Work.empty()) {
+                        std::string Name = std::move(Work.back());
+                        Work.pop_back();
+                        auto &Def = Functions[Name];
+                        for (auto &Callee : Def.Callees)
+                            if (Seen.insert(Callee).second)
+                                Work.push_back(Callee);
+                        if (!Def.Pending)
+                            continue;
+
+                        std::unique_lock<std::mutex> Guard(Def.Pending->Lock);
+                        Def.Pending->Finished.wait(
+                            Guard, [&] { return Def.Pending->Done; });
+                        if (Def.Pending->Failed)
+                            return make_error<StringError>(
+                                Name + " failed to compile",
+                                inconvertibleErrorCode());
+                    }
+                    return Error::success();
+                }
+
+                // Blocks until nothing defined by defineFunctionAsync is still
+                // compiling.
+                void waitForCompiles() {
+                    for (auto &Entry : Functions) {
+                        auto &Pending = Entry.second.Pending;
+                        if (!Pending)
+                            continue;
+                        std::unique_lock<std::mutex> Guard(Pending->Lock);
+                        Pending->Finished.wait(Guard,
+                                               [&] { return Pending->Done; });
+                    }
+                }
+
+                // The definitions that have failed to compile since the last
+                // call, and why.
+                std::vector<std::pair<std::string, std::string>>
+                takeCompileFailures() {
+                    std::lock_guard<std::mutex> Guard(FailuresLock);
+                    return std::exchange(Failures, {});
+                }
+
+                // Limits the bytes of JIT memory in use (as counted by the
+                // slab pool) to Bytes, evicting least recently called
+                // functions. Zero means unlimited. Must be set before any
+                // function is defined.
+                Error setMemoryBudget(size_t Bytes) {
+                    if (!Slabs || !Bytes)
+                        return Error::success();
+
+                    auto LCTM = createLocalLazyCallThroughManager(
+                        ES->getExecutorProcessControl().getTargetTriple(), *ES,
+                        ExecutorAddr::fromPtr(&handleCallThroughError));
+                    if (!LCTM)
+                        return LCTM.takeError();
+                    CallThrough = std::move(*LCTM);
+                    MemoryBudget = Bytes;
+                    return Error::success();
+                }
+
+                // Starts a new top-level execution; functions called from
+                // here on count as used in this epoch.
+                void advanceEpoch() { Epoch++; }
+
+                // Evicts cold functions until usage is back within budget.
+                // Only call between top-level executions, when no JIT'd frame
+                // can be live.
+                Error enforceMemoryBudget() {
+                    if (!MemoryBudget || Slabs->getBytesUsed() <= MemoryBudget)
+                        return Error::success();
+
+                    std::vector<StringMapEntry<FunctionDef> *> Resident;
+                    for (auto &Entry : Functions)
+                        if (Entry.second.Resident)
+                            Resident.push_back(&Entry);
+                    std::sort(Resident.begin(), Resident.end(),
+                              [](auto *A, auto *B) {
+                                  return *A->second.LastUsed <
+                                         *B->second.LastUsed;
+                              });
+
+                    for (auto *Entry : Resident) {
+                        if (Slabs->getBytesUsed() <= MemoryBudget)
+                            break;
+                        if (auto Err = evict(Entry->first(), Entry->second))
+                            return Err;
+                    }
+                    return Error::success();
+                }
+
+                void printStats(raw_ostream &OS) const {
+                    if (Slabs)
+                        Slabs->printStats(OS);
+                    else
+                        OS << "JIT memory: slabs disabled\n";
+                    if (MemoryBudget)
+                        OS << "JIT memory budget: " << MemoryBudget
+                           << " bytes, " << Evictions << " evictions, "
+                           << Rematerializations << " rematerializations\n";
+                }
         };
 
     } // end namespace orc
@@ -4,13 +4,20 @@
 
 #include "debug.h"
 #include "lexer.h"
+#include "stats.h"
 
-Lexer::Lexer(FILE *inStream) : inStream(inStream) { lastChar = ' '; }
+Lexer::Lexer(FILE *inStream) : inStream(inStream), trackLocations(debug) {
+    lastChar = ' ';
+}
 
 std::string Lexer::getIdentifierValue() { return identifierStr; }
 
 double Lexer::getNumericValue() { return numVal; }
 
+bool Lexer::isIntegerValue() { return numIsInt; }
+
+uint64_t Lexer::getLineCount() { return lineCount; }
+
 void Lexer::readIdentifierOrKeyword() {
     identifierStr = lastChar;
     while (isalnum((lastChar = advance()))) {
@@ -27,6 +34,7 @@ void Lexer::readNumeric() {
     } while (isdigit(lastChar) || lastChar == '.');
 
     numVal = std::strtod(buffer.c_str(), nullptr);
+    numIsInt = buffer.find('.') == std::string::npos && numVal < 0x1p63;
 }
 
 void Lexer::readComment() {
@@ -37,23 +45,29 @@ void Lexer::readComment() {
 
 int Lexer::advance() {
     int lastChar = getc(inStream);
+    lineCount += lastChar == '\n';
+    if (!trackLocations)
+        return lastChar;
 
-    if (debug) {
-        if (lastChar == '\n' || lastChar == '\r') {
-            lexLoc.line++;
-            lexLoc.col = 0;
-        } else
-            lexLoc.col++;
-    }
+    if (lastChar == '\n' || lastChar == '\r') {
+        lexLoc.line++;
+        lexLoc.col = 0;
+    } else
+        lexLoc.col++;
 
     return lastChar;
 }
 
 int Lexer::getTok() {
+    PhaseScope phase(Phase::Lex);
+
     while (isspace(lastChar)) {
         lastChar = advance();
     }
 
+    if (trackLocations)
+        curLoc = lexLoc;
+
     if (isalpha(lastChar)) {
         readIdentifierOrKeyword();
         if (identifierStr == "def")
@@ -96,5 +110,11 @@ int Lexer::getTok() {
 
     int curChar = lastChar;
     lastChar = advance();
+
+    // && and || are the only two-character tokens.
+    if ((curChar == '&' || curChar == '|') && lastChar == curChar) {
+        lastChar = advance();
+        return curChar == '&' ? tok_and : tok_or;
+    }
     return curChar;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <string>
 
 enum Token {
@@ -29,6 +31,10 @@ enum Token {
 
     // variable time
     tok_var = -13,
+
+    // short-circuit logic
+    tok_and = -14,
+    tok_or = -15,
 };
 
 class Lexer {
@@ -38,6 +44,10 @@ class Lexer {
         int getTok();
         std::string getIdentifierValue();
         double getNumericValue();
+        // Whether the last number was written without a fraction and fits
+        // an int.
+        bool isIntegerValue();
+        uint64_t getLineCount();
 
     private:
         void readIdentifierOrKeyword();
@@ -45,7 +55,11 @@ class Lexer {
         void readComment();
 
         FILE *inStream;
+        // Only maintain lexLoc/curLoc when debug info will use them.
+        bool trackLocations;
         char lastChar;
         std::string identifierStr;
         double numVal;
+        bool numIsInt;
+        uint64_t lineCount = 0;
 };
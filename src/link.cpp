@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "link.h"
+
+#ifdef KALEIDOSCOPE_HAVE_LLD
+
+#include "lld/Common/Driver.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/raw_ostream.h"
+
+LLD_HAS_DRIVER(elf)
+
+// The runtime archive, built from runtime.cpp, profiler.cpp and dataset.cpp
+// alongside the compiler.
+asm(".pushsection .rodata\n"
+    ".balign 8\n"
+    ".globl kaleidoscopeRuntimeArchive\n"
+    ".hidden kaleidoscopeRuntimeArchive\n"
+    "kaleidoscopeRuntimeArchive:\n"
+    ".incbin \"" KALEIDOSCOPE_RUNTIME_ARCHIVE "\"\n"
+    ".globl kaleidoscopeRuntimeArchiveEnd\n"
+    ".hidden kaleidoscopeRuntimeArchiveEnd\n"
+    "kaleidoscopeRuntimeArchiveEnd:\n"
+    ".popsection\n");
+
+extern "C" const char kaleidoscopeRuntimeArchive[];
+extern "C" const char kaleidoscopeRuntimeArchiveEnd[];
+
+// The build bakes in lists of paths separated by colons.
+std::vector<std::string> splitPaths(llvm::StringRef paths) {
+    llvm::SmallVector<llvm::StringRef> parts;
+    paths.split(parts, ':', -1, false);
+    return std::vector<std::string>(parts.begin(), parts.end());
+}
+
+bool linkExecutable(const std::string &object, const std::string &output) {
+    // lld reads the runtime from a file.
+    llvm::SmallString<128> runtimePath;
+    int fd;
+    if (auto ec = llvm::sys::fs::createTemporaryFile("kaleidoscope-runtime",
+                                                     "a", fd, runtimePath)) {
+        fprintf(stderr, "Error: could not write the runtime: %s\n",
+                ec.message().c_str());
+        return false;
+    }
+    llvm::FileRemover removeRuntime(runtimePath);
+    {
+        llvm::raw_fd_ostream os(fd, true);
+        os.write(kaleidoscopeRuntimeArchive,
+                 kaleidoscopeRuntimeArchiveEnd - kaleidoscopeRuntimeArchive);
+    }
+
+    // What the C driver passes for a PIE, with -rdynamic so --sample-profile
+    // can name the program's functions.
+    std::vector<std::string> args = {
+        "ld.lld",          "-pie",
+        "--eh-frame-hdr",  "--export-dynamic",
+        "-dynamic-linker", KALEIDOSCOPE_DYNAMIC_LINKER,
+        "-o",              output,
+    };
+    for (auto &file : splitPaths(KALEIDOSCOPE_CRT_BEGIN))
+        args.push_back(file);
+    for (auto &dir : splitPaths(KALEIDOSCOPE_LIB_DIRS))
+        args.push_back("-L" + dir);
+    args.push_back(object);
+    args.push_back(runtimePath.str().str());
+#if defined(__x86_64__)
+    // The vector variants of the math builtins.
+    args.push_back("-lmvec");
+#endif
+    for (auto *lib : {"-lpthread", "-ldl", "-lm", "-lc", "-lgcc", "--as-needed",
+                      "-lgcc_s", "--no-as-needed"})
+        args.push_back(lib);
+    for (auto &file : splitPaths(KALEIDOSCOPE_CRT_END))
+        args.push_back(file);
+
+    std::vector<const char *> argv;
+    for (auto &arg : args)
+        argv.push_back(arg.c_str());
+    lld::Result result = lld::lldMain(argv, llvm::outs(), llvm::errs(),
+                                      {{lld::Gnu, &lld::elf::link}});
+    return !result.retCode;
+}
+
+#else
+
+bool linkExecutable(const std::string &, const std::string &) {
+    fprintf(stderr, "Error: -o needs a compiler built with lld\n");
+    return false;
+}
+
+#endif
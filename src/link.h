@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// Links object, a compiled program's object file or archive, into the
+// executable output, in-process with lld. The runtime comes from an archive
+// embedded in the compiler, and the C library's startup files from where the
+// C compiler found them when the compiler was built, so nothing is needed
+// from the build tree. Returns false if linking failed or isn't supported.
+bool linkExecutable(const std::string &object, const std::string &output);
@@ -1,30 +1,53 @@
 #include <cassert>
 #include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/LTO/LTO.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ArchiveWriter.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Support/CodeGen.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/IPO/ThinLTOBitcodeWriter.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/WarnMissedTransforms.h"
 #include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 
 #include "kaleidoscopeJIT.h"
 
 #include "ast.h"
+#include "cache.h"
 #include "debug.h"
 #include "llvm.h"
+#include "memReport.h"
+#include "options.h"
+#include "stats.h"
 
-std::unique_ptr<llvm::LLVMContext> Context;
+llvm::orc::ThreadSafeContext tsContext;
+llvm::LLVMContext *Context;
 std::unique_ptr<llvm::IRBuilder<>> Builder;
 std::unique_ptr<llvm::Module> Module;
 std::map<std::string, llvm::AllocaInst *> NamedValues;
@@ -37,17 +60,100 @@ std::unique_ptr<llvm::PassInstrumentationCallbacks> pic;
 std::unique_ptr<llvm::StandardInstrumentations> si;
 std::unique_ptr<llvm::PassBuilder> pb;
 
+// Declared before jit, so they outlive it: the JIT's teardown frees every
+// object it loaded and tells its listeners.
+std::unique_ptr<JITCodeListener> codeListener;
+std::unique_ptr<MemReportListener> memListener;
 std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
 llvm::ExitOnError exitOnErr;
 std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+std::set<std::string> flushedFunctions;
+
+// Lets the vectorizer turn loops over the math builtins into calls to
+// glibc's libmvec, which compiled programs link against and the JIT
+// loads.
+llvm::TargetLibraryInfoImpl createLibraryInfo(const llvm::Triple &triple) {
+    llvm::TargetLibraryInfoImpl tlii(triple);
+    if (triple.getArch() == llvm::Triple::x86_64 && triple.isOSLinux() &&
+        triple.isGNUEnvironment())
+        tlii.addVectorizableFunctionsFromVecLib(
+            llvm::TargetLibraryInfoImpl::LIBMVEC_X86, triple);
+    return tlii;
+}
 
-void initializeModule() {
-    Context = std::make_unique<llvm::LLVMContext>();
+// The passes run over each function as it is defined for the JIT.
+void addFunctionPasses(llvm::FunctionPassManager &passes) {
+    passes.addPass(llvm::PromotePass());
+    passes.addPass(llvm::InstCombinePass());
+    passes.addPass(llvm::ReassociatePass());
+    passes.addPass(llvm::GVNPass());
+    passes.addPass(llvm::SimplifyCFGPass());
+    // Only loops with hints are vectorized or unrolled here, and a warning
+    // is given for any hint that wasn't followed.
+    passes.addPass(llvm::LoopVectorizePass(
+        llvm::LoopVectorizeOptions(/*InterleaveOnlyWhenForced=*/true,
+                                   /*VectorizeOnlyWhenForced=*/true)));
+    passes.addPass(llvm::LoopUnrollPass(
+        llvm::LoopUnrollOptions(2, /*OnlyWhenForced=*/true)));
+    passes.addPass(llvm::WarnMissedTransformationsPass());
+}
 
-    Module = std::make_unique<llvm::Module>("kaleidoscope", *Context);
-    if (jit) {
-        Module->setDataLayout(jit->getDataLayout());
-    }
+namespace {
+    // Prints the remarks of the passes that follow loop hints, with
+    // --loop-remarks. Without it, only hints that weren't followed are
+    // reported, as warnings.
+    class LoopRemarkHandler : public llvm::DiagnosticHandler {
+        public:
+            bool isAnalysisRemarkEnabled(llvm::StringRef pass) const override {
+                return isLoopPass(pass);
+            }
+            bool isMissedOptRemarkEnabled(llvm::StringRef pass) const override {
+                return isLoopPass(pass);
+            }
+            bool isPassedOptRemarkEnabled(llvm::StringRef pass) const override {
+                return isLoopPass(pass);
+            }
+            bool isAnyRemarkEnabled() const override { return true; }
+
+            bool handleDiagnostics(const llvm::DiagnosticInfo &di) override {
+                auto *remark =
+                    llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&di);
+                if (!remark || !isLoopPass(remark->getPassName()))
+                    return false;
+                if (!remark->isEnabled())
+                    return true;
+
+                const char *kind = "remark";
+                if (di.getSeverity() == llvm::DS_Warning)
+                    kind = "warning";
+                else if (remark->isMissed())
+                    kind = "missed";
+                else if (remark->isAnalysis())
+                    kind = "analysis";
+                llvm::errs() << kind << ": " << remark->getFunction().getName();
+                if (remark->isLocationAvailable())
+                    llvm::errs() << " (" << remark->getLocationStr() << ")";
+                llvm::errs() << ": " << remark->getMsg() << "\n";
+                return true;
+            }
+
+        private:
+            static bool isLoopPass(llvm::StringRef pass) {
+                return pass == "loop-vectorize" || pass == "loop-unroll" ||
+                       pass == "transform-warning";
+            }
+    };
+} // namespace
+
+// The context, builder and pass infrastructure live for the whole session;
+// only the module is recreated for each definition handed to the JIT.
+void initializeContext() {
+    tsContext =
+        llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+    Context = tsContext.getContext();
+    Context->setDiscardValueNames(!debug);
+    if (options.loopRemarks)
+        Context->setDiagnosticHandler(std::make_unique<LoopRemarkHandler>());
 
     Builder = std::make_unique<llvm::IRBuilder<>>(*Context);
 
@@ -59,11 +165,10 @@ void initializeModule() {
     pic = std::make_unique<llvm::PassInstrumentationCallbacks>();
     si = std::make_unique<llvm::StandardInstrumentations>(*Context, true);
 
-    fpm->addPass(llvm::PromotePass());
-    fpm->addPass(llvm::InstCombinePass());
-    fpm->addPass(llvm::ReassociatePass());
-    fpm->addPass(llvm::GVNPass());
-    fpm->addPass(llvm::SimplifyCFGPass());
+    addFunctionPasses(*fpm);
+
+    auto tlii = createLibraryInfo(llvm::Triple(llvm::sys::getProcessTriple()));
+    fam->registerPass([tlii] { return llvm::TargetLibraryAnalysis(tlii); });
 
     pb.reset(new llvm::PassBuilder());
     pb->registerModuleAnalyses(*mam);
@@ -73,13 +178,118 @@ void initializeModule() {
     pb->crossRegisterProxies(*lam, *fam, *cgam, *mam);
 }
 
+void initializeModule() {
+    Module = std::make_unique<llvm::Module>("kaleidoscope", *Context);
+    if (jit) {
+        Module->setDataLayout(jit->getDataLayout());
+        if (debug)
+            debugSetup("<stdin>");
+    }
+}
+
+// Hands the current module over and starts a fresh one in the same context.
+// Cached analyses are keyed by function address, so they have to go before
+// the functions they describe are compiled and freed by the JIT.
+llvm::orc::ThreadSafeModule takeModule() {
+    if (debug)
+        debugFinalize();
+
+    fam->clear();
+    mam->clear();
+
+    if (options.sampleProfile)
+        prepareForProfiling();
+
+    llvm::orc::ThreadSafeModule tsm(std::move(Module), tsContext);
+    // With --async-defs the module is compiled on a JIT thread while the
+    // next is codegen'd, so the next gets a context of its own.
+    if (options.asyncDefs) {
+        dbuilder.reset();
+        Builder.reset();
+        si.reset();
+        initializeContext();
+    }
+    initializeModule();
+    return tsm;
+}
+
+// The function passes codegen runs, for modules whose definitions were
+// codegen'd without them. This runs on the JIT thread compiling tsm,
+// possibly alongside others, so it builds its own pass managers.
+llvm::Expected<llvm::orc::ThreadSafeModule>
+optimizeModule(llvm::orc::ThreadSafeModule tsm,
+               llvm::orc::MaterializationResponsibility &) {
+    tsm.withModuleDo([](llvm::Module &m) {
+        llvm::LoopAnalysisManager lam;
+        llvm::FunctionAnalysisManager fam;
+        llvm::CGSCCAnalysisManager cgam;
+        llvm::ModuleAnalysisManager mam;
+        llvm::PassBuilder pb;
+        auto tlii =
+            createLibraryInfo(llvm::Triple(llvm::sys::getProcessTriple()));
+        fam.registerPass([&] { return llvm::TargetLibraryAnalysis(tlii); });
+        pb.registerModuleAnalyses(mam);
+        pb.registerCGSCCAnalyses(cgam);
+        pb.registerFunctionAnalyses(fam);
+        pb.registerLoopAnalyses(lam);
+        pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+        llvm::FunctionPassManager passes;
+        addFunctionPasses(passes);
+        for (auto &f : m)
+            if (!f.isDeclaration()) {
+                passes.run(f, fam);
+                recordIRAfterPasses(f);
+            }
+    });
+    return std::move(tsm);
+}
+
+// Starts the next chunk of a streamed compile. The previous chunk has been
+// written out, so its module goes, and so does the context: the constants,
+// types and metadata it uniqued would otherwise pile up for the whole file.
+// Only the prototypes, in functionProtos, carry over.
+void startNextChunk() {
+    for (auto &f : *Module)
+        if (!f.isDeclaration() && !f.hasAvailableExternallyLinkage())
+            flushedFunctions.insert(f.getName().str());
+
+    // Everything that tracks values or metadata in the old context has to
+    // go before it does.
+    dbuilder.reset();
+    Module.reset();
+    Builder.reset();
+    si.reset();
+
+    initializeContext();
+    initializeModule();
+}
+
 void initializeJIT() {
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
 
-    jit = exitOnErr(llvm::orc::KaleidoscopeJIT::Create());
-    Module->setDataLayout(jit->getDataLayout());
+    std::unique_ptr<SlabPool> slabs;
+    if (options.jitSlabs)
+        slabs = SlabPool::create(options.jitHugePages);
+
+    jit = exitOnErr(llvm::orc::KaleidoscopeJIT::Create(
+        std::move(slabs), options.fastMath, options.asyncDefs));
+    exitOnErr(jit->setMemoryBudget(options.jitMemoryBudget));
+    if (options.asyncDefs)
+        jit->setOptimizer(optimizeModule);
+
+    if (options.perfMap || options.jitdump || options.sampleProfile) {
+        codeListener =
+            std::make_unique<JITCodeListener>(options.perfMap, options.jitdump);
+        jit->registerListener(*codeListener);
+    }
+
+    if (options.memReport) {
+        memListener = std::make_unique<MemReportListener>();
+        jit->registerListener(*memListener);
+    }
 }
 
 llvm::Function *getFunction(std::string name) {
@@ -94,44 +304,100 @@ llvm::Function *getFunction(std::string name) {
 }
 
 llvm::AllocaInst *createEntryBlockAlloca(llvm::Function *function,
-                                         llvm::StringRef varName) {
+                                         llvm::StringRef varName,
+                                         llvm::Type *type) {
     llvm::IRBuilder<> builder(&function->getEntryBlock(),
                               function->getEntryBlock().begin());
-    return builder.CreateAlloca(llvm::Type::getDoubleTy(*Context), nullptr,
-                                varName);
+    return builder.CreateAlloca(type, nullptr, varName);
+}
+
+llvm::Type *getLLVMType(ValueType type) {
+    if (type == ValueType::Int)
+        return llvm::Type::getInt64Ty(*Context);
+    return llvm::Type::getDoubleTy(*Context);
+}
+
+// The only implicit conversions. Doubles saturate when converted to ints,
+// so out-of-range values and NaN are well defined.
+llvm::Value *convertTo(llvm::Value *val, llvm::Type *type) {
+    if (val->getType() == type)
+        return val;
+    if (type->isDoubleTy())
+        return Builder->CreateSIToFP(val, type, "tofp");
+    return Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat,
+                                    {type, val->getType()}, {val}, nullptr,
+                                    "toint");
+}
+
+llvm::Value *createIsTrue(llvm::Value *val, const llvm::Twine &name) {
+    if (val->getType()->isIntegerTy())
+        return Builder->CreateICmpNE(
+            val, llvm::ConstantInt::get(val->getType(), 0), name);
+    return Builder->CreateFCmpONE(
+        val, llvm::ConstantFP::get(*Context, llvm::APFloat(0.0)), name);
 }
 
-llvm::DISubroutineType *createFunctionType(unsigned numArgs) {
+llvm::DISubroutineType *
+createFunctionType(const std::vector<ValueType> &argTypes) {
     llvm::SmallVector<llvm::Metadata *, 8> eltTys;
-    llvm::DIType *dblTy = ksDbgInfo.getDoubleTy();
 
-    eltTys.push_back(dblTy);
+    eltTys.push_back(ksDbgInfo.getDoubleTy());
 
-    for (unsigned i = 0, e = numArgs; i != e; i++) {
-        eltTys.push_back(dblTy);
+    for (ValueType type : argTypes) {
+        eltTys.push_back(ksDbgInfo.getType(type));
     }
 
     return dbuilder->createSubroutineType(
         dbuilder->getOrCreateTypeArray(eltTys));
 }
 
-void runModulePasses() {
-    llvm::ModulePassManager mpm =
-        pb->buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
-    mpm.run(*Module, *mam);
+// The sampling profiler walks frame pointers, so keep them in everything we
+// generate. A compiled program also has to start the profiler itself.
+void prepareForProfiling() {
+    for (auto &f : *Module)
+        if (!f.isDeclaration())
+            f.addFnAttr("frame-pointer", "all");
+
+    auto *mainFn = Module->getFunction("main");
+    if (jit || !mainFn || mainFn->isDeclaration())
+        return;
+
+    llvm::FunctionCallee start = Module->getOrInsertFunction(
+        "__kaleidoscope_profile_main", Builder->getVoidTy(),
+        Builder->getInt32Ty());
+    llvm::IRBuilder<> builder(&mainFn->getEntryBlock(),
+                              mainFn->getEntryBlock().getFirstInsertionPt());
+    builder.CreateCall(start, builder.getInt32(options.sampleProfile));
 }
 
-void dumpIR() { Module->print(llvm::errs(), nullptr); }
+// A machine for the target object files are built for. The targets must
+// have been initialized, which getTargetMachine does.
+std::unique_ptr<llvm::TargetMachine> createTargetMachine() {
+    auto targetTriple = llvm::sys::getDefaultTargetTriple();
 
-void writeToBitcode(const char *filename) {
-    std::error_code ec;
-    llvm::raw_fd_ostream os(filename, ec);
-    llvm::WriteBitcodeToFile(*Module.get(), os);
-    os.close();
+    std::string error;
+    auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
+    if (!target) {
+        llvm::errs() << error;
+        abort();
+    }
+
+    auto cpu = "generic";
+    auto features = "";
+
+    llvm::TargetOptions opt;
+    if (options.fastMath)
+        opt.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+        targetTriple, cpu, features, opt, llvm::Reloc::PIC_));
 }
 
-void writeObject(const char *filename) {
-    auto targetTriple = llvm::sys::getDefaultTargetTriple();
+// The shared target machine, created on first use. The module pipeline uses
+// it along with codegen so the vectorizer sees real vector widths.
+llvm::TargetMachine *getTargetMachine() {
+    static std::unique_ptr<llvm::TargetMachine> targetMachine;
+    if (targetMachine)
+        return targetMachine.get();
 
     llvm::InitializeAllTargetInfos();
     llvm::InitializeAllTargets();
@@ -139,22 +405,175 @@ void writeObject(const char *filename) {
     llvm::InitializeAllAsmParsers();
     llvm::InitializeAllAsmPrinters();
 
-    std::string error;
-    auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
-    if (!target) {
-        llvm::errs() << error;
+    targetMachine = createTargetMachine();
+    return targetMachine.get();
+}
+
+// Runs the pipeline build makes over the module. Module pipelines are for
+// the target, so they get their own pass builder rather than the session's
+// target-agnostic one.
+void runPipeline(
+    llvm::function_ref<llvm::ModulePassManager(llvm::PassBuilder &)> build) {
+    llvm::TargetMachine *targetMachine = getTargetMachine();
+    Module->setDataLayout(targetMachine->createDataLayout());
+    Module->setTargetTriple(targetMachine->getTargetTriple().str());
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::PassBuilder builder(targetMachine);
+
+    auto tlii = createLibraryInfo(targetMachine->getTargetTriple());
+    fam.registerPass([&] { return llvm::TargetLibraryAnalysis(tlii); });
+    builder.registerModuleAnalyses(mam);
+    builder.registerCGSCCAnalyses(cgam);
+    builder.registerFunctionAnalyses(fam);
+    builder.registerLoopAnalyses(lam);
+    builder.crossRegisterProxies(lam, fam, cgam, mam);
+
+    build(builder).run(*Module, mam);
+}
+
+void runModulePasses() {
+    PhaseScope phase(Phase::ModulePasses);
+    runPipeline([](llvm::PassBuilder &builder) {
+        return builder.buildPerModuleDefaultPipeline(
+            llvm::OptimizationLevel::O2);
+    });
+
+    // Functions inlined everywhere are gone by now, and keep their
+    // unoptimized sizes.
+    for (auto &f : *Module)
+        if (!f.isDeclaration())
+            recordIRAfterPasses(f);
+}
+
+// Writes the module as bitcode with the summary a thin link uses to decide
+// which functions to import from other files. Unless -g asked for no
+// optimization, the module first gets the ThinLTO pre-link pipeline, which
+// leaves cross-file inlining and vectorization to the link.
+void writeThinLTOBitcode(const char *filename) {
+    PhaseScope phase(Phase::ModulePasses);
+    std::error_code ec;
+    llvm::raw_fd_ostream os(filename, ec);
+    if (ec) {
+        llvm::errs() << "Could not open file: " << ec.message();
         abort();
     }
 
-    auto cpu = "generic";
-    auto features = "";
+    runPipeline([&](llvm::PassBuilder &builder) {
+        llvm::ModulePassManager mpm;
+        if (debugLevel != DebugLevel::Full)
+            mpm = builder.buildThinLTOPreLinkDefaultPipeline(
+                llvm::OptimizationLevel::O2);
+        mpm.addPass(llvm::ThinLTOBitcodeWriterPass(os, nullptr));
+        return mpm;
+    });
+}
 
-    llvm::TargetOptions opt;
-    auto targetMachine = target->createTargetMachine(
-        targetTriple, cpu, features, opt, llvm::Reloc::PIC_);
+// Links bitcode written by writeThinLTOBitcode. The thin link reads every
+// file's summary, imports functions small enough to inline from one file
+// into the others, and then optimizes and generates code for each file on
+// its own thread, at most jobs at once, reusing objects from the build cache
+// when there is one. Task i's object goes to kaleidoscope.<i>.o, and the
+// names of the objects are appended to objects.
+// Returns false if two files define the same function.
+bool linkThinLTO(const std::vector<std::string> &bitcodeFiles, unsigned jobs,
+                 std::vector<std::string> &objects) {
+    PhaseScope phase(Phase::Object);
+    llvm::TargetMachine *targetMachine = getTargetMachine();
+
+    llvm::lto::Config conf;
+    conf.CPU = targetMachine->getTargetCPU().str();
+    conf.Options = targetMachine->Options;
+    conf.RelocModel = llvm::Reloc::PIC_;
+    conf.DefaultTriple = targetMachine->getTargetTriple().str();
+    if (debugLevel == DebugLevel::Full)
+        conf.OptLevel = 0;
+
+    llvm::lto::LTO lto(std::move(conf),
+                       llvm::lto::createInProcessThinBackend(
+                           llvm::heavyweight_hardware_concurrency(jobs)));
+
+    // The buffers have to outlive the link. Every function has one
+    // definition, which is the one that prevails. Only main has to stay
+    // visible to the runtime's objects, unless the profiler will be naming
+    // functions through the dynamic symbol table.
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+    std::map<std::string, std::string> definedIn;
+    for (auto &file : bitcodeFiles) {
+        buffers.push_back(exitOnErr(
+            llvm::errorOrToExpected(llvm::MemoryBuffer::getFile(file))));
+        auto input = exitOnErr(
+            llvm::lto::InputFile::create(buffers.back()->getMemBufferRef()));
+
+        std::vector<llvm::lto::SymbolResolution> resolutions;
+        for (auto &sym : input->symbols()) {
+            llvm::lto::SymbolResolution res;
+            if (!sym.isUndefined()) {
+                auto [prev, added] =
+                    definedIn.emplace(sym.getName().str(), file);
+                if (!added) {
+                    llvm::errs() << "Error: " << sym.getName()
+                                 << " is defined in both " << prev->second
+                                 << " and " << file << "\n";
+                    return false;
+                }
+                res.Prevailing = true;
+                res.FinalDefinitionInLinkageUnit = true;
+                res.VisibleToRegularObj =
+                    sym.getName() == "main" || options.sampleProfile;
+            }
+            resolutions.push_back(res);
+        }
+        exitOnErr(lto.add(std::move(input), resolutions));
+    }
+
+    // Streams are requested from the backend threads, so each task's name
+    // is set up front.
+    std::vector<std::string> taskObjects(lto.getMaxTasks());
+    for (unsigned task = 0; task != taskObjects.size(); task++)
+        taskObjects[task] = "kaleidoscope." + std::to_string(task) + ".o";
+    auto addStream = [&](unsigned task, const llvm::Twine &)
+        -> llvm::Expected<std::unique_ptr<llvm::CachedFileStream>> {
+        std::error_code ec;
+        auto os =
+            std::make_unique<llvm::raw_fd_ostream>(taskObjects[task], ec);
+        if (ec)
+            return llvm::errorCodeToError(ec);
+        return std::make_unique<llvm::CachedFileStream>(std::move(os),
+                                                        taskObjects[task]);
+    };
+    // Stale objects from an earlier link would otherwise be archived along
+    // with the tasks that wrote nothing.
+    for (auto &object : taskObjects)
+        llvm::sys::fs::remove(object);
+    exitOnErr(lto.run(addStream, cacheForLTO(taskObjects)));
+    if (!options.cacheDir.empty())
+        cachePrune();
+
+    for (auto &object : taskObjects)
+        if (llvm::sys::fs::exists(object))
+            objects.push_back(object);
+    return true;
+}
+
+void dumpIR() { Module->print(llvm::errs(), nullptr); }
 
+void writeToBitcode(const char *filename) {
+    PhaseScope phase(Phase::Bitcode);
+    std::error_code ec;
+    llvm::raw_fd_ostream os(filename, ec);
+    llvm::WriteBitcodeToFile(*Module.get(), os);
+    os.close();
+}
+
+void writeObject(const char *filename) {
+    PhaseScope phase(Phase::Object);
+    llvm::TargetMachine *targetMachine = getTargetMachine();
     Module->setDataLayout(targetMachine->createDataLayout());
-    Module->setTargetTriple(targetTriple);
+    Module->setTargetTriple(targetMachine->getTargetTriple().str());
 
     std::error_code ec;
     llvm::raw_fd_ostream os(filename, ec);
@@ -173,3 +592,57 @@ void writeObject(const char *filename) {
     pass.run(*Module);
     os.flush();
 }
+
+// Splits the module by function into partitions and generates code for each
+// on its own thread, with its own target machine, writing <stem>.<i>.o.
+// Functions keep external linkage, so calls between partitions resolve at
+// link time. Appends the objects' names to objects.
+void writeObjectsParallel(const std::string &stem, unsigned partitions,
+                          std::vector<std::string> &objects) {
+    PhaseScope phase(Phase::Object);
+    llvm::TargetMachine *targetMachine = getTargetMachine();
+    Module->setDataLayout(targetMachine->createDataLayout());
+    Module->setTargetTriple(targetMachine->getTargetTriple().str());
+
+    std::vector<std::unique_ptr<llvm::raw_fd_ostream>> files;
+    std::vector<llvm::raw_pwrite_stream *> streams;
+    for (unsigned i = 0; i != partitions; i++) {
+        objects.push_back(stem + "." + std::to_string(i) + ".o");
+        std::error_code ec;
+        files.push_back(
+            std::make_unique<llvm::raw_fd_ostream>(objects.back(), ec));
+        if (ec) {
+            llvm::errs() << "Could not open file: " << ec.message();
+            abort();
+        }
+        streams.push_back(files.back().get());
+    }
+
+    llvm::splitCodeGen(*Module, streams, {}, createTargetMachine,
+                       llvm::CodeGenFileType::ObjectFile);
+
+    for (auto &file : files)
+        file->close();
+}
+
+// Bundles the objects of a streamed or parallel compile into one static
+// archive, which links like the single object a serial compile writes, and
+// removes them.
+void writeObjectArchive(const char *filename,
+                        const std::vector<std::string> &objects) {
+    PhaseScope phase(Phase::Object);
+    std::vector<llvm::NewArchiveMember> members;
+    for (auto &object : objects)
+        members.push_back(
+            exitOnErr(llvm::NewArchiveMember::getFile(object, true)));
+
+    auto kind = getTargetMachine()->getTargetTriple().isOSDarwin()
+                    ? llvm::object::Archive::K_DARWIN
+                    : llvm::object::Archive::K_GNU;
+    exitOnErr(llvm::writeArchive(filename, members,
+                                 llvm::SymtabWritingMode::NormalSymtab, kind,
+                                 true, false));
+
+    for (auto &object : objects)
+        llvm::sys::fs::remove(object);
+}
@@ -2,9 +2,11 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
@@ -15,11 +17,14 @@
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
 
+#include "jitListener.h"
 #include "kaleidoscopeJIT.h"
+#include "memReport.h"
 
 #include "ast.h"
 
-extern std::unique_ptr<llvm::LLVMContext> Context;
+extern llvm::orc::ThreadSafeContext tsContext;
+extern llvm::LLVMContext *Context;
 extern std::unique_ptr<llvm::IRBuilder<>> Builder;
 extern std::unique_ptr<llvm::Module> Module;
 extern std::map<std::string, llvm::AllocaInst *> NamedValues;
@@ -33,20 +38,43 @@ extern std::unique_ptr<llvm::PassInstrumentationCallbacks> pic;
 extern std::unique_ptr<llvm::StandardInstrumentations> si;
 
 extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+extern std::unique_ptr<JITCodeListener> codeListener;
+extern std::unique_ptr<MemReportListener> memListener;
 extern llvm::ExitOnError exitOnErr;
 extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+// Functions defined in chunks of a streamed compile already written out.
+extern std::set<std::string> flushedFunctions;
 
+void initializeContext();
 void initializeModule();
+void startNextChunk();
 void initializeJIT();
+llvm::orc::ThreadSafeModule takeModule();
 
 llvm::Function *getFunction(std::string name);
 llvm::AllocaInst *createEntryBlockAlloca(llvm::Function *function,
-                                         llvm::StringRef varName);
+                                         llvm::StringRef varName,
+                                         llvm::Type *type);
 
-llvm::DISubroutineType *createFunctionType(unsigned numArgs);
+llvm::Type *getLLVMType(ValueType type);
+llvm::Value *convertTo(llvm::Value *val, llvm::Type *type);
+// Compares an int or double condition against zero.
+llvm::Value *createIsTrue(llvm::Value *val, const llvm::Twine &name);
 
+llvm::DISubroutineType *
+createFunctionType(const std::vector<ValueType> &argTypes);
+
+void prepareForProfiling();
+llvm::TargetMachine *getTargetMachine();
 void runModulePasses();
+void writeThinLTOBitcode(const char *filename);
+bool linkThinLTO(const std::vector<std::string> &bitcodeFiles, unsigned jobs,
+                 std::vector<std::string> &objects);
 
 void dumpIR();
 void writeToBitcode(const char *filename);
 void writeObject(const char *filename);
+void writeObjectsParallel(const std::string &stem, unsigned partitions,
+                          std::vector<std::string> &objects);
+void writeObjectArchive(const char *filename,
+                        const std::vector<std::string> &objects);
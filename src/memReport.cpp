@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+#include "memReport.h"
+#include "options.h"
+#include "stats.h"
+
+namespace {
+    constexpr unsigned numAstNodes = (unsigned)AstNode::Function + 1;
+
+    const char *astNodeNames[numAstNodes] = {
+        "number", "variable", "binary", "unary",     "call",
+        "if",     "for",      "var",    "prototype", "function",
+    };
+
+    struct AstNodeStats {
+            uint64_t count = 0;
+            uint64_t bytes = 0;
+    };
+
+    // Sizes are -1 until recorded.
+    struct FunctionIR {
+            std::string name;
+            long blocks = -1, instructions = -1;
+            long blocksAfter = -1, instructionsAfter = -1;
+    };
+
+    struct JITObject {
+            std::string module;
+            uint64_t code = 0, data = 0;
+    };
+
+    AstNodeStats astNodes[numAstNodes];
+
+    // Recorded from JIT threads as well as the main one.
+    std::mutex lock;
+    std::vector<FunctionIR> functions;
+    // The latest entry for each name, which a redefinition replaces.
+    std::map<std::string, size_t> latestFunction;
+    std::vector<JITObject> jitObjects;
+
+    // How many entries of a long list the text report shows.
+    constexpr size_t shownEntries = 20;
+
+    // Indices of the largest entries of items, by size, in order.
+    template <typename T, typename Size>
+    std::vector<size_t> largest(const std::vector<T> &items, Size size) {
+        std::vector<size_t> order(items.size());
+        for (size_t i = 0; i != order.size(); i++)
+            order[i] = i;
+        size_t shown = std::min(order.size(), shownEntries);
+        std::partial_sort(order.begin(), order.begin() + shown, order.end(),
+                          [&](size_t a, size_t b) {
+                              return size(items[a]) > size(items[b]);
+                          });
+        order.resize(shown);
+        return order;
+    }
+
+    void printCount(llvm::raw_ostream &out, long count) {
+        if (count < 0)
+            out << llvm::format(" %9s", (const char *)"-");
+        else
+            out << llvm::format(" %9ld", count);
+    }
+
+    llvm::json::Value countOrNull(long count) {
+        if (count < 0)
+            return nullptr;
+        return (int64_t)count;
+    }
+} // namespace
+
+void countAstNode(AstNode kind, size_t bytes) {
+    if (!options.memReport)
+        return;
+    astNodes[(unsigned)kind].count++;
+    astNodes[(unsigned)kind].bytes += bytes;
+}
+
+void recordIRBeforePasses(const llvm::Function &f) {
+    if (!options.memReport)
+        return;
+    std::lock_guard<std::mutex> guard(lock);
+    latestFunction[f.getName().str()] = functions.size();
+    functions.push_back({f.getName().str(), (long)f.size(),
+                         (long)f.getInstructionCount()});
+}
+
+void recordIRAfterPasses(const llvm::Function &f) {
+    if (!options.memReport)
+        return;
+    std::lock_guard<std::mutex> guard(lock);
+    auto entry = latestFunction.find(f.getName().str());
+    // The JIT renames fib to fib.2 for its second definition.
+    if (entry == latestFunction.end())
+        entry = latestFunction.find(f.getName().rsplit('.').first.str());
+    if (entry == latestFunction.end())
+        return;
+    functions[entry->second].blocksAfter = f.size();
+    functions[entry->second].instructionsAfter = f.getInstructionCount();
+}
+
+void MemReportListener::notifyObjectLoaded(
+    ObjectKey key, const llvm::object::ObjectFile &obj,
+    const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+    // The JIT names each object after its module.
+    JITObject object;
+    llvm::StringRef name = obj.getFileName();
+    name.consume_back("-jitted-objectbuffer");
+    object.module = name.str();
+
+    for (const auto &section : obj.sections()) {
+        if (!info.getSectionLoadAddress(section))
+            continue;
+        (section.isText() ? object.code : object.data) += section.getSize();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    jitObjects.push_back(std::move(object));
+}
+
+void printMemReport(llvm::raw_ostream &out) {
+    std::lock_guard<std::mutex> guard(lock);
+    out << "memory report:\n";
+
+    out << "  AST node              count      bytes\n";
+    AstNodeStats total;
+    for (unsigned i = 0; i != numAstNodes; i++) {
+        const AstNodeStats &stats = astNodes[i];
+        total.count += stats.count;
+        total.bytes += stats.bytes;
+        if (stats.count)
+            out << llvm::format("    %-16s %10llu %10llu\n", astNodeNames[i],
+                                (unsigned long long)stats.count,
+                                (unsigned long long)stats.bytes);
+    }
+    out << llvm::format("    %-16s %10llu %10llu\n", (const char *)"total",
+                        (unsigned long long)total.count,
+                        (unsigned long long)total.bytes);
+
+    if (!functions.empty()) {
+        out << "  IR, largest " << std::min(functions.size(), shownEntries)
+            << " of " << functions.size() << " functions\n";
+        out << "    function               blocks     insts"
+               "    blocks     insts (optimized)\n";
+        for (size_t i : largest(functions, [](const FunctionIR &f) {
+                 return std::max(f.instructions, f.instructionsAfter);
+             })) {
+            const FunctionIR &f = functions[i];
+            out << llvm::format("    %-20s", f.name.c_str());
+            printCount(out, f.blocks);
+            printCount(out, f.instructions);
+            printCount(out, f.blocksAfter);
+            printCount(out, f.instructionsAfter);
+            out << "\n";
+        }
+    }
+
+    if (!jitObjects.empty()) {
+        uint64_t code = 0, data = 0;
+        for (auto &object : jitObjects) {
+            code += object.code;
+            data += object.data;
+        }
+        out << "  JIT, largest " << std::min(jitObjects.size(), shownEntries)
+            << " of " << jitObjects.size() << " objects\n";
+        out << "    module                   code      data\n";
+        for (size_t i : largest(jitObjects, [](const JITObject &object) {
+                 return object.code + object.data;
+             }))
+            out << llvm::format("    %-20s %9llu %9llu\n",
+                                jitObjects[i].module.c_str(),
+                                (unsigned long long)jitObjects[i].code,
+                                (unsigned long long)jitObjects[i].data);
+        out << llvm::format("    %-20s %9llu %9llu\n", (const char *)"total",
+                            (unsigned long long)code,
+                            (unsigned long long)data);
+    }
+
+    out << "  phase            peak rss    growth\n";
+    for (auto &phase : getPhaseMemory())
+        out << llvm::format("    %-16s %8ldKB %8ldKB\n", phase.phase,
+                            phase.peakRSSKiB, phase.rssGrowthKiB);
+    out << llvm::format("    %-16s %8ldKB\n", (const char *)"peak",
+                        getPeakRSSKiB());
+}
+
+bool writeMemReportJSON(const char *fileName) {
+    std::error_code ec;
+    llvm::raw_fd_ostream file(fileName, ec);
+    if (ec) {
+        fprintf(stderr, "Error: could not write %s: %s\n", fileName,
+                ec.message().c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    llvm::json::OStream json(file, 2);
+    json.object([&] {
+        json.attributeObject("ast", [&] {
+            for (unsigned i = 0; i != numAstNodes; i++)
+                json.attributeObject(astNodeNames[i], [&] {
+                    json.attribute("count", (int64_t)astNodes[i].count);
+                    json.attribute("bytes", (int64_t)astNodes[i].bytes);
+                });
+        });
+        json.attributeArray("functions", [&] {
+            for (auto &f : functions)
+                json.object([&] {
+                    json.attribute("name", f.name);
+                    json.attribute("blocks", countOrNull(f.blocks));
+                    json.attribute("instructions",
+                                   countOrNull(f.instructions));
+                    json.attribute("blocksOptimized",
+                                   countOrNull(f.blocksAfter));
+                    json.attribute("instructionsOptimized",
+                                   countOrNull(f.instructionsAfter));
+                });
+        });
+        json.attributeArray("jit", [&] {
+            for (auto &object : jitObjects)
+                json.object([&] {
+                    json.attribute("module", object.module);
+                    json.attribute("codeBytes", (int64_t)object.code);
+                    json.attribute("dataBytes", (int64_t)object.data);
+                });
+        });
+        json.attributeArray("phases", [&] {
+            for (auto &phase : getPhaseMemory())
+                json.object([&] {
+                    json.attribute("phase", phase.phase);
+                    json.attribute("peakRSSKiB", (int64_t)phase.peakRSSKiB);
+                    json.attribute("rssGrowthKiB",
+                                   (int64_t)phase.rssGrowthKiB);
+                });
+        });
+        json.attribute("peakRSSKiB", (int64_t)getPeakRSSKiB());
+    });
+    file << "\n";
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Where --mem-report writes the JSON version of its report.
+constexpr const char *memReportFileName = "kaleidoscope.mem.json";
+
+// The kinds of AST node --mem-report counts, one per class in ast.h.
+enum class AstNode {
+    Number,
+    Variable,
+    Binary,
+    Unary,
+    Call,
+    If,
+    For,
+    Var,
+    Prototype,
+    Function,
+};
+
+// Heap bytes owned directly by s or v, beyond the object itself.
+inline size_t heapBytes(const std::string &s) {
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+template <typename T> size_t heapBytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+// The recorders below do nothing without --mem-report.
+
+// Counts a node of kind taking bytes, its own and those of any strings and
+// vectors it holds, but not its children's.
+void countAstNode(AstNode kind, size_t bytes);
+
+// Records f's blocks and instructions once it's codegen'd, and again once
+// it's optimized. Optimization may happen on a JIT thread, after f has been
+// renamed to a versioned name like fib.2.
+void recordIRBeforePasses(const llvm::Function &f);
+void recordIRAfterPasses(const llvm::Function &f);
+
+// Records the code and data bytes of each object the JIT loads.
+class MemReportListener : public llvm::JITEventListener {
+    public:
+        void notifyObjectLoaded(
+            ObjectKey key, const llvm::object::ObjectFile &obj,
+            const llvm::RuntimeDyld::LoadedObjectInfo &info) override;
+};
+
+// Prints everything recorded, with the peak RSS after each phase. Long
+// lists are cut to their largest entries; the JSON has them all.
+void printMemReport(llvm::raw_ostream &out);
+bool writeMemReportJSON(const char *fileName);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+struct Options {
+        // Print per-line REPL latency histograms on exit.
+        bool latencyHistogram = false;
+        // Compile runs of top-level expressions as one module. Defaults to
+        // on when stdin is not a terminal.
+        bool batchExprs = false;
+        // Compile REPL definitions on background threads, returning to the
+        // prompt once they are codegen'd. A top-level expression waits only
+        // for the definitions it calls.
+        bool asyncDefs = false;
+        // Pack JIT'd objects into shared slabs rather than giving each its
+        // own SectionMemoryManager, optionally on 2MB hugetlb pages.
+        bool jitSlabs = true;
+        bool jitHugePages = false;
+        // Evict least recently called functions once JIT memory in use
+        // exceeds this many bytes (0 for no limit).
+        size_t jitMemoryBudget = 0;
+        // Print JIT memory usage on exit.
+        bool jitStats = false;
+        // Publish JIT'd functions to perf through /tmp/perf-<pid>.map and/or
+        // a jitdump file.
+        bool perfMap = false;
+        bool jitdump = false;
+        // Sample the running program this many times per CPU second and
+        // report where it spent its time on exit (0 for off).
+        unsigned sampleProfile = 0;
+        // Compile every function as if it were declared `def fastmath`.
+        bool fastMath = false;
+        // Print the loop vectorizer's and unroller's remarks, including
+        // whether they followed each loop's hints.
+        bool loopRemarks = false;
+        // Print the time and memory spent in each compiler phase on exit.
+        bool timeReport = false;
+        // Report AST, IR and JIT sizes and peak RSS after each phase on
+        // exit, to stderr and as JSON in kaleidoscope.mem.json.
+        bool memReport = false;
+        // Compile a file in chunks of this many definitions, each optimized
+        // and written out as its own object before the next is parsed, and
+        // archive the objects at the end (0 for one module).
+        unsigned streamChunk = 0;
+        // Split each module written out into this many partitions and
+        // generate code for them in parallel, archiving the objects.
+        unsigned codegenThreads = 1;
+        // Compile and link this many of several input files at once (0 for
+        // one per hardware thread).
+        unsigned jobs = 0;
+        // Reuse outputs from, and add them to, the build cache in this
+        // directory, evicting least recently used entries past cacheSize
+        // bytes (no cache if empty).
+        std::string cacheDir;
+        size_t cacheSize = size_t(1) << 30;
+};
+
+extern Options options;
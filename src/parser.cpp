@@ -8,65 +8,212 @@
 #include "debug.h"
 #include "lexer.h"
 #include "llvm.h"
+#include "options.h"
 #include "parser.h"
+#include "profiler.h"
+#include "stats.h"
 
-Parser::Parser(Lexer &lexer) : lexer(lexer) {}
+Parser::Parser(Lexer &lexer)
+    : lexer(lexer), defLatency("def"), redefLatency("redef"),
+      externLatency("extern"),
+      exprLatency("expr"), batchLatency("expr batch") {}
 
 void Parser::run() {
     while (true) {
         switch (curTok) {
             case tok_eof:
+                flushBatch();
+                if (options.asyncDefs) {
+                    jit->waitForCompiles();
+                    reportCompileFailures();
+                }
                 return;
             case ';':
                 getNextToken();
                 break;
             case tok_def:
+                flushBatch();
                 if (auto ast = parseDefinition()) {
+                    std::string name = ast->getName();
+                    LatencyScope timer(latencyFor(
+                        jit->hasFunction(name) ? redefLatency : defLatency));
+                    auto lock = tsContext.getLock();
                     if (auto *ir = ast->codegen()) {
-                        exitOnErr(jit->addModule(llvm::orc::ThreadSafeModule(
-                            std::move(Module), std::move(Context))));
-                        initializeModule();
+                        PhaseScope phase(Phase::JIT);
+                        if (options.asyncDefs)
+                            exitOnErr(
+                                jit->defineFunctionAsync(name, takeModule()));
+                        else
+                            exitOnErr(jit->defineFunction(name, takeModule()));
                     }
                 } else
                     getNextToken();
+                reportCompileFailures();
                 fprintf(stderr, "kaleidoscope> ");
                 break;
             case tok_extern:
+                flushBatch();
                 if (auto ast = parseExtern()) {
+                    LatencyScope timer(latencyFor(externLatency));
+                    auto lock = tsContext.getLock();
                     if (auto *ir = ast->codegen()) {
                         functionProtos[ast->getName()] = std::move(ast);
                     }
                 } else
                     getNextToken();
+                reportCompileFailures();
                 fprintf(stderr, "kaleidoscope> ");
                 break;
             default:
-                if (auto ast = parseTopLevelExpr()) {
-                    if (auto *ir = ast->codegen()) {
-                        auto rt =
-                            jit->getMainJITDylib().createResourceTracker();
-                        auto tsm = llvm::orc::ThreadSafeModule(
-                            std::move(Module), std::move(Context));
-                        exitOnErr(jit->addModule(std::move(tsm), rt));
-                        initializeModule();
+                if (options.batchExprs)
+                    batchTopLevelExpr();
+                else
+                    runTopLevelExpr();
+                break;
+        }
+    }
+}
 
-                        auto exprSymbol = exitOnErr(jit->lookup("__anon_expr"));
+// Prints why definitions compiled in the background with --async-defs
+// failed, for those that have since the last prompt.
+void Parser::reportCompileFailures() {
+    if (!options.asyncDefs)
+        return;
+    for (auto &[name, message] : jit->takeCompileFailures())
+        fprintf(stderr, "Error: def %s: %s\n", name.c_str(), message.c_str());
+}
 
-                        double (*fp)() =
-                            exprSymbol.getAddress().toPtr<double (*)()>();
-                        fprintf(stderr, "Evaluated to %f\n", fp());
+// With --async-defs, waits for the definitions tsm calls to finish
+// compiling. Returns false, having said why, if one of them failed.
+bool Parser::calleesReady(llvm::orc::ThreadSafeModule &tsm) {
+    if (!options.asyncDefs)
+        return true;
+
+    PhaseScope phase(Phase::JIT);
+    llvm::Error err = jit->waitForCallees(tsm);
+    reportCompileFailures();
+    if (!err)
+        return true;
+    fprintf(stderr, "Error: %s\n", llvm::toString(std::move(err)).c_str());
+    return false;
+}
 
-                        exitOnErr(rt->remove());
-                    }
-                } else
-                    getNextToken();
-                fprintf(stderr, "kaleidoscope> ");
-                break;
+void Parser::runTopLevelExpr() {
+    if (auto ast = parseTopLevelExpr("__anon_expr")) {
+        LatencyScope timer(latencyFor(exprLatency));
+        // The module is unlocked before it is compiled, which may happen on
+        // another thread.
+        llvm::orc::ThreadSafeModule tsm;
+        {
+            auto lock = tsContext.getLock();
+            if (ast->codegen())
+                tsm = takeModule();
         }
+        if (tsm && calleesReady(tsm)) {
+            auto rt = jit->getMainJITDylib().createResourceTracker();
+            double (*fp)();
+            {
+                PhaseScope phase(Phase::JIT);
+                exitOnErr(jit->addModule(std::move(tsm), rt));
+                auto exprSymbol = exitOnErr(jit->lookup("__anon_expr"));
+                fp = exprSymbol.getAddress().toPtr<double (*)()>();
+            }
+            jit->advanceEpoch();
+            fprintf(stderr, "Evaluated to %f\n", fp());
+
+            if (options.sampleProfile)
+                profilerFlush();
+            exitOnErr(rt->remove());
+            exitOnErr(jit->enforceMemoryBudget());
+        }
+    } else
+        getNextToken();
+    fprintf(stderr, "kaleidoscope> ");
+}
+
+// Codegens a top-level expression as a uniquely named thunk in the current
+// module, deferring compilation and execution until the run of expressions
+// ends. Everything it would have printed is replayed by flushBatch().
+void Parser::batchTopLevelExpr() {
+    PendingExpr &pending = batch.emplace_back();
+    deferredErrors = &pending.errors;
+
+    std::string name = "__anon_expr." + std::to_string(batchThunks);
+    if (auto ast = parseTopLevelExpr(name)) {
+        LatencyScope timer(latencyFor(exprLatency));
+        auto lock = tsContext.getLock();
+        if (auto *ir = ast->codegen()) {
+            pending.thunk = name;
+            batchThunks++;
+        }
+    } else
+        getNextToken();
+
+    deferredErrors = nullptr;
+}
+
+// Compiles the batched thunks as one module and runs them in source order,
+// interleaving their results with the deferred diagnostics and prompts
+// exactly as the one-at-a-time mode would have printed them.
+void Parser::flushBatch() {
+    if (batch.empty())
+        return;
+
+    LatencyScope timer(latencyFor(batchLatency));
+    llvm::orc::ThreadSafeModule tsm;
+    if (batchThunks) {
+        auto lock = tsContext.getLock();
+        tsm = takeModule();
     }
+
+    // If a definition the batch calls failed to compile, none of it runs.
+    llvm::orc::ResourceTrackerSP rt;
+    if (tsm && calleesReady(tsm)) {
+        PhaseScope phase(Phase::JIT);
+        rt = jit->getMainJITDylib().createResourceTracker();
+        exitOnErr(jit->addModule(std::move(tsm), rt));
+    }
+
+    for (auto &pending : batch) {
+        fputs(pending.errors.c_str(), stderr);
+        if (!pending.thunk.empty() && rt) {
+            double (*fp)();
+            {
+                PhaseScope phase(Phase::JIT);
+                auto exprSymbol = exitOnErr(jit->lookup(pending.thunk));
+                fp = exprSymbol.getAddress().toPtr<double (*)()>();
+            }
+            jit->advanceEpoch();
+            fprintf(stderr, "Evaluated to %f\n", fp());
+        }
+        fprintf(stderr, "kaleidoscope> ");
+    }
+
+    if (options.sampleProfile)
+        profilerFlush();
+    if (rt)
+        exitOnErr(rt->remove());
+    exitOnErr(jit->enforceMemoryBudget());
+
+    batch.clear();
+    batchThunks = 0;
+}
+
+void Parser::printLatencyReport(llvm::raw_ostream &out) const {
+    out << "REPL latency (codegen through result, excluding parse):\n";
+    defLatency.print(out);
+    redefLatency.print(out);
+    externLatency.print(out);
+    exprLatency.print(out);
+    if (batchLatency.getCount())
+        batchLatency.print(out);
+}
+
+LatencyHistogram *Parser::latencyFor(LatencyHistogram &hist) {
+    return options.latencyHistogram ? &hist : nullptr;
 }
 
-void Parser::parseStream() {
+void Parser::parseStream(const std::function<void()> &defined) {
     while (true) {
         switch (curTok) {
             case tok_eof:
@@ -76,7 +223,8 @@ void Parser::parseStream() {
                 break;
             case tok_def:
                 if (auto ast = parseDefinition()) {
-                    ast->codegen();
+                    if (ast->codegen() && defined)
+                        defined();
                 } else
                     getNextToken();
                 break;
@@ -87,7 +235,7 @@ void Parser::parseStream() {
                     getNextToken();
                 break;
             default:
-                if (auto ast = parseTopLevelExpr()) {
+                if (auto ast = parseTopLevelExpr("main")) {
                     ast->codegen();
                 } else
                     getNextToken();
@@ -99,7 +247,7 @@ void Parser::parseStream() {
 int Parser::getNextToken() { return curTok = lexer.getTok(); }
 
 int Parser::getTokPrecedence() {
-    if (!isascii(curTok))
+    if (!isascii(curTok) && curTok != tok_and && curTok != tok_or)
         return -1;
 
     auto pair = binopPrecedence.find(curTok);
@@ -109,7 +257,7 @@ int Parser::getTokPrecedence() {
 }
 
 std::unique_ptr<ExprAST> Parser::logError(const char *str) {
-    fprintf(stderr, "Error: %s\n", str);
+    LogErrorV(str);
     return nullptr;
 }
 
@@ -119,7 +267,8 @@ std::unique_ptr<PrototypeAST> Parser::logErrorP(const char *str) {
 }
 
 std::unique_ptr<ExprAST> Parser::parseNumberExpr() {
-    auto res = std::make_unique<NumberExprAST>(lexer.getNumericValue());
+    auto res = std::make_unique<NumberExprAST>(lexer.getNumericValue(),
+                                               lexer.isIntegerValue());
     getNextToken();
     return std::move(res);
 }
@@ -228,6 +377,10 @@ std::unique_ptr<ExprAST> Parser::parseForExpr() {
             return nullptr;
     }
 
+    auto hints = parseLoopHints();
+    if (!hints)
+        return nullptr;
+
     if (curTok != tok_in)
         return logError("expected in after for");
 
@@ -238,11 +391,75 @@ std::unique_ptr<ExprAST> Parser::parseForExpr() {
         return nullptr;
 
     return std::make_unique<ForExprAST>(name, std::move(start), std::move(end),
-                                        std::move(step), std::move(body));
+                                        std::move(step), std::move(body),
+                                        *hints);
+}
+
+// Parses any hints before a for loop's `in`: `unroll`, optionally with a
+// count, `vectorize`, optionally with a width, and `interleave` with a
+// count. They're only words here, so they can still name variables. The
+// vectorizer ignores widths and counts that aren't powers of 2 within its
+// limits, so those are errors.
+std::optional<LoopHints> Parser::parseLoopHints() {
+    LoopHints hints;
+    while (curTok == tok_identifier) {
+        std::string hint = lexer.getIdentifierValue();
+        if (hint != "unroll" && hint != "vectorize" && hint != "interleave")
+            break;
+        getNextToken();
+
+        unsigned count = 0;
+        if (curTok == tok_number) {
+            double value = lexer.getNumericValue();
+            if (!lexer.isIntegerValue() || value < 1 || value > 1024) {
+                logError("expected a count from 1 to 1024 in loop hint");
+                return std::nullopt;
+            }
+            count = (unsigned)value;
+            getNextToken();
+        }
+
+        if (hint == "unroll") {
+            hints.unroll = true;
+            hints.unrollCount = count;
+            continue;
+        }
+        if (hint == "interleave" && !count) {
+            logError("expected a count after interleave");
+            return std::nullopt;
+        }
+        unsigned max = hint == "vectorize" ? 64 : 16;
+        if (count & (count - 1) || count > max) {
+            logError(hint == "vectorize"
+                         ? "vectorize width must be a power of 2 up to 64"
+                         : "interleave count must be a power of 2 up to 16");
+            return std::nullopt;
+        }
+        if (hint == "vectorize") {
+            hints.vectorize = true;
+            hints.vectorizeWidth = count;
+        } else
+            hints.interleaveCount = count;
+    }
+    return hints;
+}
+
+// Parses the type in a ':' annotation.
+std::optional<ValueType> Parser::parseType() {
+    getNextToken(); // eat ':'
+    if (curTok == tok_identifier) {
+        std::string name = lexer.getIdentifierValue();
+        if (name == "int" || name == "double") {
+            getNextToken();
+            return name == "int" ? ValueType::Int : ValueType::Double;
+        }
+    }
+    logError("expected 'int' or 'double' after ':'");
+    return std::nullopt;
 }
 
 std::unique_ptr<ExprAST> Parser::parseVarExpr() {
-    std::vector<VarNamePair> varNames;
+    std::vector<VarBinding> varNames;
 
     do {
         getNextToken(); // eats "var" or comma
@@ -252,6 +469,13 @@ std::unique_ptr<ExprAST> Parser::parseVarExpr() {
         std::string name = lexer.getIdentifierValue();
         getNextToken();
 
+        std::optional<ValueType> type;
+        if (curTok == ':') {
+            type = parseType();
+            if (!type)
+                return nullptr;
+        }
+
         std::unique_ptr<ExprAST> init;
         if (curTok == '=') {
             getNextToken();
@@ -261,7 +485,7 @@ std::unique_ptr<ExprAST> Parser::parseVarExpr() {
                 return nullptr;
         }
 
-        varNames.emplace_back(name, std::move(init));
+        varNames.push_back({name, std::move(init), type});
     } while (curTok == ',');
 
     if (curTok != tok_in)
@@ -339,7 +563,9 @@ Parser::parseExpressionRest(int minPrecedence, std::unique_ptr<ExprAST> prev) {
     }
 }
 
-std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
+// After def, `fastmath` followed by a prototype is an annotation rather than
+// a function name; it's reported through fastMath.
+std::unique_ptr<PrototypeAST> Parser::parsePrototype(bool *fastMath) {
     std::string name;
     unsigned kind = 0, binaryPrecedence = 30;
 
@@ -350,6 +576,12 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
             name = lexer.getIdentifierValue();
             kind = 0;
             getNextToken();
+            if (fastMath && !*fastMath && name == "fastmath" &&
+                (curTok == tok_identifier || curTok == tok_unary ||
+                 curTok == tok_binary)) {
+                *fastMath = true;
+                return parsePrototype(fastMath);
+            }
             break;
         case tok_unary:
             getNextToken();
@@ -382,8 +614,19 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
         return logErrorP("Expected '(' in prototype");
 
     std::vector<std::string> argNames;
-    while (getNextToken() == tok_identifier)
+    std::vector<ValueType> argTypes;
+    getNextToken();
+    while (curTok == tok_identifier) {
         argNames.push_back(lexer.getIdentifierValue());
+        argTypes.push_back(ValueType::Double);
+        getNextToken();
+        if (curTok == ':') {
+            auto type = parseType();
+            if (!type)
+                return nullptr;
+            argTypes.back() = *type;
+        }
+    }
 
     if (curTok != ')')
         return logErrorP("Expected ')' in prototype");
@@ -392,30 +635,42 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
     if (kind && argNames.size() != kind)
         return logErrorP("Invalid number of operands for operator");
 
-    return std::make_unique<PrototypeAST>(name, std::move(argNames), kind != 0,
+    return std::make_unique<PrototypeAST>(name, std::move(argNames),
+                                          std::move(argTypes), kind != 0,
                                           binaryPrecedence);
 }
 
 std::unique_ptr<FunctionAST> Parser::parseDefinition() {
+    PhaseScope phase(Phase::Parse);
     getNextToken();
-    auto prototype = parsePrototype();
+    bool fastMath = false;
+    auto prototype = parsePrototype(&fastMath);
     if (!prototype)
         return nullptr;
 
     if (auto expression = parseExpression())
-        return std::make_unique<FunctionAST>(std::move(prototype),
-                                             std::move(expression));
+        return std::make_unique<FunctionAST>(
+            std::move(prototype), std::move(expression), fastMath);
     return nullptr;
 }
 
+// Externs follow the C ABI of the runtime, which only deals in doubles.
 std::unique_ptr<PrototypeAST> Parser::parseExtern() {
+    PhaseScope phase(Phase::Parse);
     getNextToken();
-    return parsePrototype();
+    auto proto = parsePrototype();
+    if (!proto)
+        return nullptr;
+    for (ValueType type : proto->getArgTypes())
+        if (type != ValueType::Double)
+            return logErrorP("extern arguments must be double");
+    return proto;
 }
 
-std::unique_ptr<FunctionAST> Parser::parseTopLevelExpr() {
+std::unique_ptr<FunctionAST>
+Parser::parseTopLevelExpr(const std::string &name) {
+    PhaseScope phase(Phase::Parse);
     if (auto expression = parseExpression()) {
-        std::string name = jit ? "__anon_expr" : "main";
         auto prototype =
             std::make_unique<PrototypeAST>(name, std::vector<std::string>());
         return std::make_unique<FunctionAST>(std::move(prototype),
@@ -1,16 +1,24 @@
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "ast.h"
 #include "lexer.h"
+#include "stats.h"
 
 class Parser {
     public:
         Parser(Lexer &lexer);
         int getNextToken();
         void run();
-        void parseStream();
+        // Parses and compiles a whole file, calling defined after each
+        // definition is compiled.
+        void parseStream(const std::function<void()> &defined = nullptr);
+        void printLatencyReport(llvm::raw_ostream &out) const;
 
     private:
         int getTokPrecedence();
@@ -21,17 +29,38 @@ class Parser {
         std::unique_ptr<ExprAST> parseIdentifierExpr();
         std::unique_ptr<ExprAST> parseIfExpr();
         std::unique_ptr<ExprAST> parseForExpr();
+        std::optional<LoopHints> parseLoopHints();
+        std::optional<ValueType> parseType();
         std::unique_ptr<ExprAST> parseVarExpr();
         std::unique_ptr<ExprAST> parseUnary();
         std::unique_ptr<ExprAST> parsePrimary();
         std::unique_ptr<ExprAST> parseExpression();
         std::unique_ptr<ExprAST>
         parseExpressionRest(int minPrecedence, std::unique_ptr<ExprAST> prev);
-        std::unique_ptr<PrototypeAST> parsePrototype();
+        std::unique_ptr<PrototypeAST> parsePrototype(bool *fastMath = nullptr);
         std::unique_ptr<FunctionAST> parseDefinition();
         std::unique_ptr<PrototypeAST> parseExtern();
-        std::unique_ptr<FunctionAST> parseTopLevelExpr();
+        std::unique_ptr<FunctionAST> parseTopLevelExpr(const std::string &name);
+
+        void runTopLevelExpr();
+        void batchTopLevelExpr();
+        void flushBatch();
+        void reportCompileFailures();
+        bool calleesReady(llvm::orc::ThreadSafeModule &tsm);
+
+        LatencyHistogram *latencyFor(LatencyHistogram &hist);
 
         Lexer lexer;
         int curTok;
+        LatencyHistogram defLatency, redefLatency, externLatency, exprLatency,
+            batchLatency;
+
+        // A top-level expression waiting in the current batch, along with the
+        // diagnostics it produced while being parsed and codegen'd.
+        struct PendingExpr {
+                std::string thunk;
+                std::string errors;
+        };
+        std::vector<PendingExpr> batch;
+        unsigned batchThunks = 0;
 };
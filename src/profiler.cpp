@@ -0,0 +1,601 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <ucontext.h>
+#endif
+
+#include "profiler.h"
+
+// No std containers or operator new below: this file is linked into
+// compiled programs by the C driver, without libstdc++.
+namespace {
+    constexpr unsigned maxFrames = 64;
+    constexpr unsigned ringSize = 4096;
+
+    struct RingSlot {
+            std::atomic<uint64_t> seq;
+            uint32_t depth;
+            uint64_t pcs[maxFrames];
+    };
+
+    // Bounded queue in the style of Vyukov's: a slot is free for position
+    // pos when its seq is pos and holds a sample once its seq is pos + 1.
+    // The producer is a signal handler, so a full ring drops the sample
+    // rather than waiting for the drainer.
+    RingSlot ring[ringSize];
+    std::atomic<uint64_t> ringHead;
+    uint64_t ringTail;
+    std::atomic<uint64_t> dropped;
+
+    // Samples drained from the ring, each stored as its depth followed by
+    // its pcs, leaf first.
+    uint64_t *sampleLog;
+    size_t sampleLogSize, sampleLogCap;
+    size_t resolvedUpTo;
+
+    // pc -> symbol cache. Caller frames are keyed by return address - 1 so
+    // they resolve to the line of the call.
+    struct Site {
+            uint64_t pc;
+            uint32_t func;
+            uint32_t file;
+            uint32_t line;
+    };
+    Site *sites;
+    size_t numSites, sitesCap;
+
+    // Interned function and file names; index + 1 in the table, 0 if empty.
+    char **strings;
+    size_t numStrings, stringsCap;
+    uint32_t *stringTable;
+    size_t stringTableCap;
+
+    ProfileResolver resolver;
+    unsigned sampleHz;
+    bool running;
+
+#ifdef __linux__
+    pthread_mutex_t samplesLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t profiledThread;
+    pthread_t drainer;
+    std::atomic<bool> stopDrainer;
+    struct sigaction oldAction;
+    uintptr_t stackLo, stackHi;
+#endif
+
+    [[noreturn]] void outOfMemory() {
+        fprintf(stderr, "Error: profiler out of memory\n");
+        abort();
+    }
+
+    void *checkedRealloc(void *p, size_t size) {
+        p = realloc(p, size);
+        if (!p)
+            outOfMemory();
+        return p;
+    }
+
+    void *checkedCalloc(size_t count, size_t size) {
+        void *p = calloc(count, size);
+        if (!p)
+            outOfMemory();
+        return p;
+    }
+
+    void appendSample(const uint64_t *pcs, uint32_t depth) {
+        if (sampleLogSize + depth + 1 > sampleLogCap) {
+            sampleLogCap = (sampleLogCap + depth + 1) * 2;
+            sampleLog = (uint64_t *)checkedRealloc(
+                sampleLog, sampleLogCap * sizeof(uint64_t));
+        }
+        sampleLog[sampleLogSize++] = depth;
+        memcpy(sampleLog + sampleLogSize, pcs, depth * sizeof(uint64_t));
+        sampleLogSize += depth;
+    }
+
+    void ringPush(const uint64_t *pcs, uint32_t depth) {
+        uint64_t pos = ringHead.load(std::memory_order_relaxed);
+        while (true) {
+            RingSlot &slot = ring[pos & (ringSize - 1)];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (ringHead.compare_exchange_weak(pos, pos + 1,
+                                                   std::memory_order_relaxed)) {
+                    slot.depth = depth;
+                    memcpy(slot.pcs, pcs, depth * sizeof(uint64_t));
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return;
+                }
+            } else if (seq < pos) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else
+                pos = ringHead.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Moves everything in the ring into the sample log. Caller holds
+    // samplesLock.
+    void drainRing() {
+        while (true) {
+            RingSlot &slot = ring[ringTail & (ringSize - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != ringTail + 1)
+                return;
+            appendSample(slot.pcs, slot.depth);
+            slot.seq.store(ringTail + ringSize, std::memory_order_release);
+            ringTail++;
+        }
+    }
+
+    uint32_t hashString(const char *str) {
+        uint32_t hash = 2166136261u;
+        for (; *str; str++)
+            hash = (hash ^ (unsigned char)*str) * 16777619u;
+        return hash;
+    }
+
+    uint32_t intern(const char *str) {
+        if ((numStrings + 1) * 2 > stringTableCap) {
+            size_t cap = stringTableCap ? stringTableCap * 2 : 256;
+            uint32_t *table = (uint32_t *)checkedCalloc(cap, sizeof(uint32_t));
+            for (size_t i = 0; i != numStrings; i++) {
+                size_t slot = hashString(strings[i]) & (cap - 1);
+                while (table[slot])
+                    slot = (slot + 1) & (cap - 1);
+                table[slot] = i + 1;
+            }
+            free(stringTable);
+            stringTable = table;
+            stringTableCap = cap;
+        }
+
+        size_t slot = hashString(str) & (stringTableCap - 1);
+        for (; stringTable[slot]; slot = (slot + 1) & (stringTableCap - 1))
+            if (!strcmp(strings[stringTable[slot] - 1], str))
+                return stringTable[slot] - 1;
+
+        if (numStrings == stringsCap) {
+            stringsCap = stringsCap ? stringsCap * 2 : 128;
+            strings =
+                (char **)checkedRealloc(strings, stringsCap * sizeof(char *));
+        }
+        size_t len = strlen(str) + 1;
+        strings[numStrings] = (char *)memcpy(checkedRealloc(nullptr, len),
+                                             str, len);
+        stringTable[slot] = ++numStrings;
+        return numStrings - 1;
+    }
+
+    size_t siteSlot(const Site *table, size_t cap, uint64_t pc) {
+        size_t slot = (pc * 0x9E3779B97F4A7C15ull >> 32) & (cap - 1);
+        while (table[slot].pc && table[slot].pc != pc)
+            slot = (slot + 1) & (cap - 1);
+        return slot;
+    }
+
+    const Site &resolveSite(uint64_t pc) {
+        if ((numSites + 1) * 2 > sitesCap) {
+            size_t cap = sitesCap ? sitesCap * 2 : 1024;
+            Site *table = (Site *)checkedCalloc(cap, sizeof(Site));
+            for (size_t i = 0; i != sitesCap; i++)
+                if (sites[i].pc)
+                    table[siteSlot(table, cap, sites[i].pc)] = sites[i];
+            free(sites);
+            sites = table;
+            sitesCap = cap;
+        }
+
+        Site &site = sites[siteSlot(sites, sitesCap, pc)];
+        if (site.pc)
+            return site;
+
+        ProfileSymbol sym;
+        sym.name[0] = sym.file[0] = 0;
+        sym.line = 0;
+        if (!resolver || !resolver(pc, &sym) || !sym.name[0])
+            snprintf(sym.name, sizeof(sym.name), "[unknown]");
+
+        site.pc = pc;
+        site.func = intern(sym.name);
+        site.file = intern(sym.file);
+        site.line = sym.line;
+        numSites++;
+        return site;
+    }
+
+    uint64_t siteKey(const uint64_t *pcs, uint32_t frame) {
+        return frame ? pcs[frame] - 1 : pcs[frame];
+    }
+
+    // Resolves every sample logged since the last call. Caller holds
+    // samplesLock.
+    void resolvePending() {
+        while (resolvedUpTo < sampleLogSize) {
+            uint32_t depth = sampleLog[resolvedUpTo];
+            const uint64_t *pcs = sampleLog + resolvedUpTo + 1;
+            for (uint32_t i = 0; i != depth; i++)
+                resolveSite(siteKey(pcs, i));
+            resolvedUpTo += depth + 1;
+        }
+    }
+
+#ifdef __linux__
+    bool contextRegs(void *ctx, uintptr_t &pc, uintptr_t &fp) {
+        auto *uc = (ucontext_t *)ctx;
+#if defined(__x86_64__)
+        pc = uc->uc_mcontext.gregs[REG_RIP];
+        fp = uc->uc_mcontext.gregs[REG_RBP];
+        return true;
+#elif defined(__aarch64__)
+        pc = uc->uc_mcontext.pc;
+        fp = uc->uc_mcontext.regs[29];
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Frame records are {previous fp, return address} on both x86-64 and
+    // AArch64. The walk stays inside the profiled thread's stack and only
+    // moves towards its base, so a frame without a frame pointer ends it
+    // early rather than faulting.
+    void onSigprof(int sig, siginfo_t *info, void *ctx) {
+        if (!pthread_equal(pthread_self(), profiledThread))
+            return;
+        int savedErrno = errno;
+
+        uint64_t pcs[maxFrames];
+        uint32_t depth = 0;
+        uintptr_t pc, fp;
+        if (contextRegs(ctx, pc, fp)) {
+            pcs[depth++] = pc;
+            while (depth != maxFrames && fp >= stackLo &&
+                   fp + 2 * sizeof(uintptr_t) <= stackHi &&
+                   !(fp & (sizeof(uintptr_t) - 1))) {
+                uintptr_t next = ((uintptr_t *)fp)[0];
+                uintptr_t ret = ((uintptr_t *)fp)[1];
+                if (!ret)
+                    break;
+                pcs[depth++] = ret;
+                if (next <= fp)
+                    break;
+                fp = next;
+            }
+            ringPush(pcs, depth);
+        }
+
+        errno = savedErrno;
+    }
+
+    void *drainLoop(void *) {
+        // Leave the signal to the profiled thread.
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPROF);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        timespec interval = {0, 20 * 1000 * 1000};
+        while (!stopDrainer.load(std::memory_order_acquire)) {
+            nanosleep(&interval, nullptr);
+            pthread_mutex_lock(&samplesLock);
+            drainRing();
+            pthread_mutex_unlock(&samplesLock);
+        }
+        return nullptr;
+    }
+#endif
+
+    // Sort state for the comparators below, which qsort gives no context.
+    const uint64_t *sortSelf, *sortTotal;
+
+    int compareFuncs(const void *a, const void *b) {
+        uint32_t l = *(const uint32_t *)a, r = *(const uint32_t *)b;
+        if (sortSelf[l] != sortSelf[r])
+            return sortSelf[l] > sortSelf[r] ? -1 : 1;
+        if (sortTotal[l] != sortTotal[r])
+            return sortTotal[l] > sortTotal[r] ? -1 : 1;
+        return l < r ? -1 : l > r;
+    }
+
+    struct LineCount {
+            uint32_t file;
+            uint32_t line;
+            uint32_t func;
+            uint64_t count;
+    };
+
+    int compareLines(const void *a, const void *b) {
+        auto *l = (const LineCount *)a, *r = (const LineCount *)b;
+        if (l->file != r->file)
+            return l->file < r->file ? -1 : 1;
+        if (l->line != r->line)
+            return l->line < r->line ? -1 : 1;
+        return l->func < r->func ? -1 : l->func > r->func;
+    }
+
+    int compareLineCounts(const void *a, const void *b) {
+        auto *l = (const LineCount *)a, *r = (const LineCount *)b;
+        if (l->count != r->count)
+            return l->count > r->count ? -1 : 1;
+        return compareLines(a, b);
+    }
+
+    // Stacks are {depth, root, ..., leaf}; a prefix sorts before its
+    // extensions, which the tree walk relies on.
+    int compareStacks(const void *a, const void *b) {
+        const uint32_t *l = *(const uint32_t *const *)a;
+        const uint32_t *r = *(const uint32_t *const *)b;
+        uint32_t n = l[0] < r[0] ? l[0] : r[0];
+        for (uint32_t i = 1; i <= n; i++)
+            if (l[i] != r[i])
+                return l[i] < r[i] ? -1 : 1;
+        return l[0] < r[0] ? -1 : l[0] > r[0];
+    }
+
+    // Prints the callees of the node shared by stacks[lo, hi), whose
+    // common prefix is depth frames long.
+    void printTree(FILE *out, uint32_t **stacks, size_t lo, size_t hi,
+                   uint32_t depth, size_t total) {
+        size_t i = lo;
+        while (i < hi && stacks[i][0] == depth)
+            i++;
+        while (i < hi) {
+            uint32_t func = stacks[i][depth + 1];
+            size_t j = i;
+            while (j < hi && stacks[j][depth + 1] == func)
+                j++;
+            if ((j - i) * 200 >= total) {
+                fprintf(out, "  %6.1f%% %8zu  %*s%s\n",
+                        100.0 * (j - i) / total, j - i, (int)(2 * depth), "",
+                        strings[func]);
+                printTree(out, stacks, i, j, depth + 1, total);
+            }
+            i = j;
+        }
+    }
+} // namespace
+
+#ifdef __linux__
+
+bool profilerStart(unsigned hz, ProfileResolver res) {
+    if (running || !hz)
+        return false;
+
+    for (unsigned i = 0; i != ringSize; i++)
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    ringHead.store(0, std::memory_order_relaxed);
+    ringTail = 0;
+    dropped.store(0, std::memory_order_relaxed);
+    resolver = res;
+    sampleHz = hz;
+
+    profiledThread = pthread_self();
+    pthread_attr_t attr;
+    if (pthread_getattr_np(profiledThread, &attr))
+        return false;
+    void *stackAddr;
+    size_t stackSize;
+    pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+    pthread_attr_destroy(&attr);
+    stackLo = (uintptr_t)stackAddr;
+    stackHi = stackLo + stackSize;
+
+    stopDrainer.store(false, std::memory_order_relaxed);
+    if (pthread_create(&drainer, nullptr, drainLoop, nullptr))
+        return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onSigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &oldAction);
+
+    long micros = 1000000 / hz;
+    itimerval timer;
+    timer.it_interval.tv_sec = micros / 1000000;
+    timer.it_interval.tv_usec = micros ? micros % 1000000 : 1;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr)) {
+        sigaction(SIGPROF, &oldAction, nullptr);
+        stopDrainer.store(true, std::memory_order_release);
+        pthread_join(drainer, nullptr);
+        return false;
+    }
+
+    running = true;
+    return true;
+}
+
+void profilerFlush() {
+    if (!running)
+        return;
+    pthread_mutex_lock(&samplesLock);
+    drainRing();
+    resolvePending();
+    pthread_mutex_unlock(&samplesLock);
+}
+
+void profilerStop() {
+    if (!running)
+        return;
+
+    itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &oldAction, nullptr);
+
+    stopDrainer.store(true, std::memory_order_release);
+    pthread_join(drainer, nullptr);
+    drainRing();
+    running = false;
+}
+
+bool resolveNativeSymbol(uint64_t pc, ProfileSymbol *sym) {
+    Dl_info info;
+    if (!dladdr((void *)pc, &info))
+        return false;
+    if (info.dli_sname)
+        snprintf(sym->name, sizeof(sym->name), "%s", info.dli_sname);
+    else if (info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+        snprintf(sym->name, sizeof(sym->name), "[%s]",
+                 base ? base + 1 : info.dli_fname);
+    } else
+        return false;
+    return true;
+}
+
+#else
+
+bool profilerStart(unsigned hz, ProfileResolver res) { return false; }
+
+void profilerFlush() {}
+
+void profilerStop() {}
+
+bool resolveNativeSymbol(uint64_t pc, ProfileSymbol *sym) { return false; }
+
+#endif
+
+void profilerReport(FILE *out, const char *collapsedPath) {
+    resolvePending();
+
+    size_t numSamples = 0;
+    for (size_t i = 0; i < sampleLogSize; i += sampleLog[i] + 1)
+        numSamples++;
+    fprintf(out, "Sample profile: %zu samples at %u Hz (%llu dropped)\n",
+            numSamples, sampleHz,
+            (unsigned long long)dropped.load(std::memory_order_relaxed));
+    if (!numSamples)
+        return;
+
+    // Turn each sample into a root-first stack of function names, counting
+    // self and total samples per function along the way.
+    uint32_t *stackData =
+        (uint32_t *)checkedRealloc(nullptr, sampleLogSize * sizeof(uint32_t));
+    uint32_t **stacks =
+        (uint32_t **)checkedRealloc(nullptr, numSamples * sizeof(uint32_t *));
+    uint64_t *self = (uint64_t *)checkedCalloc(numStrings, sizeof(uint64_t));
+    uint64_t *total = (uint64_t *)checkedCalloc(numStrings, sizeof(uint64_t));
+    uint64_t *lastSeen =
+        (uint64_t *)checkedCalloc(numStrings, sizeof(uint64_t));
+    LineCount *lines =
+        (LineCount *)checkedRealloc(nullptr, numSamples * sizeof(LineCount));
+    size_t numLines = 0;
+
+    size_t sample = 0;
+    for (size_t i = 0; i < sampleLogSize; i += sampleLog[i] + 1, sample++) {
+        uint32_t depth = sampleLog[i];
+        const uint64_t *pcs = sampleLog + i + 1;
+        uint32_t *stack = stackData + i;
+        stack[0] = depth;
+        for (uint32_t f = 0; f != depth; f++) {
+            const Site &site = resolveSite(siteKey(pcs, f));
+            stack[depth - f] = site.func;
+            if (lastSeen[site.func] != sample + 1) {
+                lastSeen[site.func] = sample + 1;
+                total[site.func]++;
+            }
+            if (!f) {
+                self[site.func]++;
+                if (site.line)
+                    lines[numLines++] = {site.file, site.line, site.func, 1};
+            }
+        }
+        stacks[sample] = stack;
+    }
+
+    uint32_t *funcs =
+        (uint32_t *)checkedRealloc(nullptr, numStrings * sizeof(uint32_t));
+    size_t numFuncs = 0;
+    for (size_t f = 0; f != numStrings; f++)
+        if (total[f])
+            funcs[numFuncs++] = f;
+    sortSelf = self;
+    sortTotal = total;
+    qsort(funcs, numFuncs, sizeof(uint32_t), compareFuncs);
+
+    fprintf(out, "\nFlat profile:\n    self%%     self   total%%    total  "
+                 "function\n");
+    for (size_t i = 0; i != numFuncs; i++) {
+        uint32_t f = funcs[i];
+        fprintf(out, "  %6.1f%% %8llu  %6.1f%% %8llu  %s\n",
+                100.0 * self[f] / numSamples, (unsigned long long)self[f],
+                100.0 * total[f] / numSamples, (unsigned long long)total[f],
+                strings[f]);
+    }
+
+    if (numLines) {
+        qsort(lines, numLines, sizeof(LineCount), compareLines);
+        size_t numDistinct = 0;
+        for (size_t i = 0; i != numLines; i++) {
+            if (numDistinct &&
+                !compareLines(&lines[numDistinct - 1], &lines[i]))
+                lines[numDistinct - 1].count++;
+            else
+                lines[numDistinct++] = lines[i];
+        }
+        qsort(lines, numDistinct, sizeof(LineCount), compareLineCounts);
+
+        fprintf(out, "\nHot lines:\n    self%%     self  location\n");
+        for (size_t i = 0; i != numDistinct && i != 20; i++)
+            fprintf(out, "  %6.1f%% %8llu  %s:%u (%s)\n",
+                    100.0 * lines[i].count / numSamples,
+                    (unsigned long long)lines[i].count,
+                    strings[lines[i].file], lines[i].line,
+                    strings[lines[i].func]);
+    }
+
+    qsort(stacks, numSamples, sizeof(uint32_t *), compareStacks);
+    fprintf(out, "\nCall tree (under 0.5%% omitted):\n   total%%    total  "
+                 "function\n");
+    printTree(out, stacks, 0, numSamples, 0, numSamples);
+
+    if (collapsedPath) {
+        FILE *collapsed = fopen(collapsedPath, "w");
+        if (!collapsed)
+            fprintf(stderr, "Error: could not open %s\n", collapsedPath);
+        for (size_t i = 0; collapsed && i != numSamples;) {
+            size_t j = i + 1;
+            while (j != numSamples &&
+                   !compareStacks(&stacks[i], &stacks[j]))
+                j++;
+            for (uint32_t f = 1; f <= stacks[i][0]; f++)
+                fprintf(collapsed, "%s%s", f == 1 ? "" : ";",
+                        strings[stacks[i][f]]);
+            fprintf(collapsed, " %zu\n", j - i);
+            i = j;
+        }
+        if (collapsed)
+            fclose(collapsed);
+    }
+
+    free(funcs);
+    free(lines);
+    free(lastSeen);
+    free(total);
+    free(self);
+    free(stacks);
+    free(stackData);
+}
+
+namespace {
+    void reportAtExit() {
+        profilerStop();
+        profilerReport(stderr, collapsedStacksFileName);
+    }
+} // namespace
+
+extern "C" void __kaleidoscope_profile_main(int hz) {
+    if (profilerStart(hz, resolveNativeSymbol))
+        atexit(reportAtExit);
+}
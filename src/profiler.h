@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+// Sampling profiler for environments without perf. A SIGPROF timer records
+// the interrupted pc and the frame pointer chain above it into a lock-free
+// ring, which a background thread drains into the sample log. Samples are
+// resolved to function names (and source lines, when the resolver knows
+// them) on flush and at report time.
+//
+// Everything here is plain libc, so executables built from the compiler's
+// object files (linked with the C driver) can carry the profiler too.
+
+constexpr const char *collapsedStacksFileName = "kaleidoscope.folded";
+
+struct ProfileSymbol {
+        char name[256];
+        char file[256];
+        unsigned line;
+};
+
+// Fills in sym for the code at pc. Returns false if pc isn't known.
+typedef bool (*ProfileResolver)(uint64_t pc, ProfileSymbol *sym);
+
+// Starts sampling the calling thread hz times per second of CPU time.
+// Returns false if a profile is already running or setup failed.
+bool profilerStart(unsigned hz, ProfileResolver resolver);
+// Resolves everything sampled so far. Call before freeing code that may
+// have been sampled, since the resolver can't see it afterwards.
+void profilerFlush();
+void profilerStop();
+// Prints flat, hot-line and call-tree reports to out, and writes collapsed
+// stacks ("root;...;leaf count" per distinct stack, for flamegraph.pl) to
+// collapsedPath unless it's null.
+void profilerReport(FILE *out, const char *collapsedPath);
+
+// Resolves pc through the dynamic symbol table, so executables only get
+// names for their own functions when linked with -rdynamic.
+bool resolveNativeSymbol(uint64_t pc, ProfileSymbol *sym);
+
+// Called at the top of main by programs compiled with --sample-profile.
+// Profiles the whole run and reports to stderr at exit.
+extern "C" void __kaleidoscope_profile_main(int hz);
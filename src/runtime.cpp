@@ -1,4 +1,11 @@
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "runtime.h"
 
@@ -38,3 +45,81 @@ double printNewLine() {
     fflush(stdout);
     return 0.0;
 }
+
+namespace {
+    // Benchmarked results go here, so the calls can't be dropped.
+    volatile double benchSink;
+
+    int compareDoubles(const void *a, const void *b) {
+        double x = *(const double *)a, y = *(const double *)b;
+        return (x > y) - (x < y);
+    }
+} // namespace
+
+// Doubles hold these exactly for the first 104 days of uptime, or about a
+// month of cycles at 3GHz, and differences stay close well beyond that.
+double nanotime() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return (double)__rdtsc();
+#elif defined(__aarch64__)
+    uint64_t count;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(count));
+    return (double)count;
+#else
+    return nanotime();
+#endif
+}
+
+// Calls f about iters times and prints the time per call. Calls are timed
+// in batches long enough that reading the clock doesn't show, so with a
+// fast f each sample is its batch's average. Finding the batch size warms
+// f up, as does a tenth of iters on top. Returns the median.
+double runbench(double (*f)(), double iters, const char *name) {
+    long calls = iters < 1 ? 1 : (long)iters;
+
+    for (long i = 0; i < calls / 10; i++)
+        benchSink = f();
+
+    long batch = 1;
+    while (batch < calls) {
+        double start = nanotime();
+        for (long i = 0; i != batch; i++)
+            benchSink = f();
+        if (nanotime() - start >= 1000)
+            break;
+        batch *= 2;
+    }
+    if (batch > calls)
+        batch = calls;
+
+    long count = calls / batch;
+    double *samples = (double *)malloc(count * sizeof(double));
+    if (!samples) {
+        fprintf(stderr, "Error: bench %s: out of memory\n", name);
+        return 0.0;
+    }
+    for (long i = 0; i != count; i++) {
+        double start = nanotime();
+        for (long j = 0; j != batch; j++)
+            benchSink = f();
+        samples[i] = (nanotime() - start) / batch;
+    }
+
+    qsort(samples, count, sizeof(double), compareDoubles);
+    double median = samples[count / 2];
+    // The smallest sample at least 99% of them don't exceed.
+    long p99 = (count * 99 + 99) / 100 - 1;
+    fprintf(stdout,
+            "bench %s: %ld calls in batches of %ld, per call: min %.1fns, "
+            "median %.1fns, p99 %.1fns\n",
+            name, count * batch, batch, samples[0], median, samples[p99]);
+    fflush(stdout);
+    free(samples);
+    return median;
+}
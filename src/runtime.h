@@ -10,3 +10,23 @@ extern "C" DLLEXPORT double put(double val);
 extern "C" DLLEXPORT double printStar();
 extern "C" DLLEXPORT double printSpace();
 extern "C" DLLEXPORT double printNewLine();
+
+// Timing. Calls to nanotime and cycles need no extern; bench(f, iters) is
+// compiled to a runbench call with f's address and name.
+extern "C" DLLEXPORT double nanotime();
+extern "C" DLLEXPORT double cycles();
+extern "C" DLLEXPORT double runbench(double (*f)(), double iters,
+                                     const char *name);
+
+// Datasets, in dataset.cpp. Handles are small numbers; failures return -1,
+// and reads past the end NaN.
+extern "C" DLLEXPORT double dataopen(double slot);
+extern "C" DLLEXPORT double datacreate(double slot);
+extern "C" DLLEXPORT double datalen(double handle);
+extern "C" DLLEXPORT double dataget(double handle, double index);
+extern "C" DLLEXPORT double datanext(double handle);
+extern "C" DLLEXPORT double dataeof(double handle);
+extern "C" DLLEXPORT double dataprefetch(double handle, double index);
+extern "C" DLLEXPORT double datawrite(double handle, double value);
+extern "C" DLLEXPORT double datarow(double handle);
+extern "C" DLLEXPORT double dataclose(double handle);
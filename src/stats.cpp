@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <sys/resource.h>
+#include <vector>
+
+#include "llvm/Support/Format.h"
+
+#include "stats.h"
+
+LatencyHistogram::LatencyHistogram(std::string name) : name(std::move(name)) {}
+
+void LatencyHistogram::record(StatClock::duration d) {
+    uint64_t micros =
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+
+    unsigned bucket = 0;
+    while (bucket + 1 < numBuckets && (micros >> (bucket + 1)))
+        bucket++;
+
+    buckets[bucket]++;
+    count++;
+    totalMicros += micros;
+    maxMicros = std::max(maxMicros, micros);
+}
+
+uint64_t LatencyHistogram::getCount() const { return count; }
+
+// Upper bound of the bucket holding the p-th percentile sample.
+uint64_t LatencyHistogram::percentile(double p) const {
+    uint64_t rank = (uint64_t)(p * count);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i != numBuckets; i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return std::min(maxMicros, (uint64_t(2) << i) - 1);
+    }
+    return maxMicros;
+}
+
+void LatencyHistogram::print(llvm::raw_ostream &out) const {
+    out << name << ": " << count << " samples";
+    if (!count)
+        return void(out << '\n');
+
+    out << ", mean " << totalMicros / count << "us, p50 <= "
+        << percentile(0.5) << "us, p90 <= " << percentile(0.9)
+        << "us, p99 <= " << percentile(0.99) << "us, max " << maxMicros
+        << "us\n";
+
+    uint64_t peak = *std::max_element(buckets.begin(), buckets.end());
+    for (unsigned i = 0; i != numBuckets; i++) {
+        if (!buckets[i])
+            continue;
+        unsigned width = (unsigned)(40 * buckets[i] / peak);
+        out << llvm::format("  %10llu - %10llu us | %8llu ",
+                            i ? (unsigned long long)1 << i : 0ULL,
+                            ((unsigned long long)2 << i) - 1,
+                            (unsigned long long)buckets[i])
+            << std::string(std::max(width, 1u), '#') << '\n';
+    }
+}
+
+LatencyScope::LatencyScope(LatencyHistogram *hist)
+    : hist(hist), start(StatClock::now()) {}
+
+LatencyScope::~LatencyScope() {
+    if (hist)
+        hist->record(StatClock::now() - start);
+}
+
+bool phaseTimingEnabled = false;
+
+namespace {
+    struct PhaseStats {
+            StatClock::duration time{};
+            uint64_t count = 0;
+            long rssGrowthKiB = 0;
+            long peakRSSKiB = 0;
+    };
+
+    const char *phaseNames[numPhases] = {
+        "lex",           "parse",  "codegen", "function-passes",
+        "module-passes", "bitcode", "object",  "jit",
+    };
+
+    std::array<PhaseStats, numPhases> phaseStats;
+    std::vector<Phase> phaseStack;
+    StatClock::time_point lastSwitch;
+    long lastMaxRSSKiB = 0;
+
+    long maxRSSKiB() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    // Charges the time since the last phase change to the innermost phase.
+    void chargeCurrent(StatClock::time_point now) {
+        if (!phaseStack.empty())
+            phaseStats[(unsigned)phaseStack.back()].time += now - lastSwitch;
+        lastSwitch = now;
+    }
+} // namespace
+
+void enterPhase(Phase phase) {
+    chargeCurrent(StatClock::now());
+    phaseStack.push_back(phase);
+    phaseStats[(unsigned)phase].count++;
+}
+
+void exitPhase() {
+    chargeCurrent(StatClock::now());
+    Phase phase = phaseStack.back();
+    phaseStack.pop_back();
+
+    if (phase != Phase::Lex) {
+        long rss = maxRSSKiB();
+        phaseStats[(unsigned)phase].rssGrowthKiB += rss - lastMaxRSSKiB;
+        phaseStats[(unsigned)phase].peakRSSKiB = rss;
+        lastMaxRSSKiB = rss;
+    }
+}
+
+void startPhaseTiming() {
+    phaseTimingEnabled = true;
+    lastMaxRSSKiB = maxRSSKiB();
+}
+
+std::vector<PhaseMemory> getPhaseMemory() {
+    std::vector<PhaseMemory> phases;
+    for (unsigned i = 0; i != numPhases; i++)
+        if (phaseStats[i].count && (Phase)i != Phase::Lex)
+            phases.push_back({phaseNames[i], phaseStats[i].peakRSSKiB,
+                              phaseStats[i].rssGrowthKiB});
+    return phases;
+}
+
+long getPeakRSSKiB() { return maxRSSKiB(); }
+
+void printTimeReport(llvm::raw_ostream &out, uint64_t lines) {
+    double total = 0;
+    for (auto &stats : phaseStats)
+        total += std::chrono::duration<double>(stats.time).count();
+
+    out << "time report: " << lines << " lines\n";
+    out << "  phase               seconds      %      calls        lines/s"
+           "   rss growth\n";
+    for (unsigned i = 0; i != numPhases; i++) {
+        const PhaseStats &stats = phaseStats[i];
+        if (!stats.count)
+            continue;
+        double seconds = std::chrono::duration<double>(stats.time).count();
+        out << llvm::format(
+            "  %-16s %10.4f %5.1f%% %10llu %14.0f %10ldKB\n", phaseNames[i],
+            seconds, total ? 100 * seconds / total : 0.0,
+            (unsigned long long)stats.count, seconds ? lines / seconds : 0.0,
+            stats.rssGrowthKiB);
+    }
+    out << llvm::format("  total            %10.4f %5.1f%% %10s %14.0f "
+                        "%10ldKB peak\n",
+                        total, 100.0, (const char *)"",
+                        total ? lines / total : 0.0, maxRSSKiB());
+}
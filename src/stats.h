@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+using StatClock = std::chrono::steady_clock;
+
+// Log2-bucketed latency histogram. Bucket i counts samples in
+// [2^i, 2^(i+1)) microseconds; bucket 0 also holds everything below 1us.
+class LatencyHistogram {
+    public:
+        LatencyHistogram(std::string name);
+        void record(StatClock::duration d);
+        uint64_t getCount() const;
+        void print(llvm::raw_ostream &out) const;
+
+    private:
+        uint64_t percentile(double p) const;
+
+        static constexpr unsigned numBuckets = 32;
+
+        std::string name;
+        std::array<uint64_t, numBuckets> buckets{};
+        uint64_t count = 0;
+        uint64_t totalMicros = 0;
+        uint64_t maxMicros = 0;
+};
+
+// Records the time between construction and destruction into a histogram.
+class LatencyScope {
+    public:
+        LatencyScope(LatencyHistogram *hist);
+        ~LatencyScope();
+
+    private:
+        LatencyHistogram *hist;
+        StatClock::time_point start;
+};
+
+// Compiler phases timed by --time-report.
+enum class Phase {
+    Lex,
+    Parse,
+    Codegen,
+    FunctionPasses,
+    ModulePasses,
+    Bitcode,
+    Object,
+    JIT,
+};
+
+constexpr unsigned numPhases = (unsigned)Phase::JIT + 1;
+
+extern bool phaseTimingEnabled;
+
+void enterPhase(Phase phase);
+void exitPhase();
+
+// Charges the time until destruction to phase. Phases nest, and time spent
+// in an inner phase isn't charged to the outer one, so the parser's time
+// excludes the lexer's. Growth in peak RSS goes to the phase that was
+// running when it was noticed, which is sampled whenever a phase other than
+// Lex ends.
+class PhaseScope {
+    public:
+        PhaseScope(Phase phase) : active(phaseTimingEnabled) {
+            if (active)
+                enterPhase(phase);
+        }
+        ~PhaseScope() {
+            if (active)
+                exitPhase();
+        }
+
+    private:
+        bool active;
+};
+
+void startPhaseTiming();
+
+// What each phase that has run did to peak RSS: the peak when it last
+// ended, and the growth charged to it. The lexer isn't sampled, so its
+// growth shows up under parse.
+struct PhaseMemory {
+        const char *phase;
+        long peakRSSKiB;
+        long rssGrowthKiB;
+};
+std::vector<PhaseMemory> getPhaseMemory();
+long getPeakRSSKiB();
+
+// Prints each phase's time, share, throughput over lines of source and peak
+// RSS growth, one phase per line for scripts to parse.
+void printTimeReport(llvm::raw_ostream &out, uint64_t lines);